@@ -0,0 +1,220 @@
+﻿#ifndef AUTO_TUNER_H
+#define AUTO_TUNER_H
+
+#include "ThreadPool.h"
+
+#if !defined(THREAD_POOL_METRICS)
+#error "AutoTuner.h measures throughput with THREAD_POOL_METRICS: define it before including ThreadPool.h"
+#endif
+
+// Hill-climbing thread count controller, in the manner of the .NET thread
+// pool. Every interval it takes the pool's completed-task count from stats(),
+// and while a backlog keeps the pool saturated it compares the throughput with
+// that of the previous thread count: a move that gained more than min_gain is
+// followed by another one in the same direction, one that lost is taken back
+// and the direction reversed. An added thread that gains nothing is taken back
+// too, a removed one that loses nothing is kept, so the count settles at the
+// smallest one reaching the plateau. Settled, it probes again every
+// hold_intervals intervals. Intervals without a backlog say nothing about
+// the thread count and leave it alone.
+//
+// Changes go through ThreadPool::resize(), so the pool needs room to grow
+// (ThreadPool::Options::max_threads); its own automatic sizing is paused
+// while the tuner runs and left as it was found afterwards. Every interval
+// ends in a Decision, passed to on_decision on the tuner's own thread.
+class AutoTuner
+{
+public:
+	enum class Action
+	{
+		GROW,
+		SHRINK,
+		HOLD
+	};
+
+	struct Decision
+	{
+		Action action = Action::HOLD;
+		const char* reason = "";  // probe, gain, loss, no gain, no loss, bound, settled, few tasks, no backlog
+		size_t threads = 0;       // During the interval
+		size_t next_threads = 0;  // From now on
+		double throughput = 0;    // Tasks per second during the interval
+		double baseline = 0;      // At the previous thread count, 0 if not compared
+		size_t queued = 0;        // Backlog at the end of the interval
+		size_t idle_workers = 0;  // Parked at the end of the interval
+		long long time_ns = 0;    // End of the interval (steady clock)
+	};
+
+	struct Options
+	{
+		size_t min_threads = 1;
+		size_t max_threads = 0;  // 0: as many as the pool can run
+		std::chrono::milliseconds interval = std::chrono::milliseconds(500);
+		size_t step = 1;  // Threads added or removed per move
+		double min_gain = 0.05;  // Relative throughput change told apart from noise
+		unsigned long long min_tasks = 100;  // Completions an interval needs to be measured
+		unsigned hold_intervals = 8;  // Settled intervals before the next probe
+		std::function<void(const Decision&)> on_decision;
+	};
+
+	explicit AutoTuner(ThreadPool& pool) : AutoTuner(pool, Options()) {}
+
+	AutoTuner(ThreadPool& pool, const Options& options)
+		: pool_(pool), options_(options), auto_sizing_(pool.auto_sizing()), direction_(1), moved_(false), probed_(false), settled_(0),
+		previous_(0), last_tasks_(pool.stats().tasks_executed), last_ns_(thread_pool_detail::now_ns()), stop_(false)
+	{
+		options_.step = std::max<size_t>(1, options_.step);
+		options_.min_threads = std::max<size_t>(1, options_.min_threads);
+		pool_.set_auto_sizing(false);
+		thread_ = std::thread([this] { run(); });
+	}
+
+	~AutoTuner()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		cond_.notify_all();
+		thread_.join();
+		pool_.set_auto_sizing(auto_sizing_);
+	}
+
+	AutoTuner(const AutoTuner&) = delete;
+	AutoTuner& operator=(const AutoTuner&) = delete;
+
+	Decision last_decision() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return last_;
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;)
+		{
+			if (cond_.wait_for(lock, options_.interval, [this] { return stop_; }))
+				return;
+			lock.unlock();
+			const Decision decision = tick();
+			if (options_.on_decision)
+				options_.on_decision(decision);
+			lock.lock();
+			last_ = decision;
+		}
+	}
+
+	Decision tick()
+	{
+		const ThreadPool::Stats stats = pool_.stats();
+		Decision decision;
+		decision.time_ns = thread_pool_detail::now_ns();
+		decision.threads = pool_.size();
+		decision.queued = stats.queued;
+		decision.idle_workers = stats.idle_workers;
+		const unsigned long long tasks = stats.tasks_executed - last_tasks_;
+		decision.throughput = decision.time_ns > last_ns_ ? tasks * 1e9 / (decision.time_ns - last_ns_) : 0;
+		last_tasks_ = stats.tasks_executed;
+		last_ns_ = decision.time_ns;
+
+		if (stats.queued == 0 && stats.idle_workers > 0)
+		{
+			// Demand-bound: nothing to learn, and no earlier sample stays comparable
+			moved_ = false;
+			probed_ = false;
+			return hold(decision, "no backlog");
+		}
+		if (tasks < options_.min_tasks)
+			return hold(decision, "few tasks");
+
+		if (!moved_)
+		{
+			if (probed_ && ++settled_ < options_.hold_intervals)
+				return hold(decision, "settled");
+			probed_ = true;
+			return move(decision, direction_, "probe");
+		}
+
+		decision.baseline = previous_;
+		const double gain = previous_ > 0 ? (decision.throughput - previous_) / previous_ : 0;
+		if (gain > options_.min_gain)
+			return move(decision, direction_, "gain");
+		if (gain < -options_.min_gain || direction_ > 0)
+		{
+			// Back to the previous count, which is known to do at least as well
+			direction_ = -direction_;
+			Decision back = move(decision, direction_, gain < -options_.min_gain ? "loss" : "no gain");
+			moved_ = false;
+			return back;
+		}
+		// Fewer threads, same throughput: keep them
+		moved_ = false;
+		settled_ = 0;
+		return hold(decision, "no loss");
+	}
+
+	Decision hold(Decision& decision, const char* reason)
+	{
+		decision.action = Action::HOLD;
+		decision.reason = reason;
+		decision.next_threads = decision.threads;
+		return decision;
+	}
+
+	// Resize by direction * step and remember the throughput to compare with;
+	// at a bound the direction turns and the count stays
+	Decision move(Decision& decision, int direction, const char* reason)
+	{
+		size_t target = decision.threads;
+		if (direction > 0)
+			target += options_.step;
+		else
+			target -= std::min(target - 1, options_.step);
+		target = std::max(target, options_.min_threads);
+		if (options_.max_threads > 0)
+			target = std::min(target, options_.max_threads);
+		if (target != decision.threads)
+		{
+			pool_.resize(target);
+			target = pool_.size();
+		}
+		if (target == decision.threads)
+		{
+			direction_ = -direction;
+			moved_ = false;
+			settled_ = 0;
+			return hold(decision, "bound");
+		}
+
+		decision.action = target > decision.threads ? Action::GROW : Action::SHRINK;
+		decision.reason = reason;
+		decision.next_threads = target;
+		previous_ = decision.throughput;
+		moved_ = true;
+		settled_ = 0;
+		return decision;
+	}
+
+	ThreadPool& pool_;
+	Options options_;
+	const bool auto_sizing_;  // The pool's setting before the tuner paused it
+
+	// Tuner thread only
+	int direction_;  // +1 grow, -1 shrink on the next move
+	bool moved_;     // The count changed at the end of the previous interval
+	bool probed_;    // A probe ran since the backlog began
+	unsigned settled_;
+	double previous_;  // Throughput before the last move
+	unsigned long long last_tasks_;
+	long long last_ns_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable cond_;
+	bool stop_;
+	Decision last_;
+	std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,450 @@
+﻿#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include "ThreadPool.h"
+
+template<class T>
+class Completion;
+
+namespace thread_pool_detail
+{
+	// Storage for the result of one task, filled in on the worker
+	template<class T>
+	struct ResultSlot
+	{
+		static_assert(alignof(T) <= allocation_align, "over-aligned result type");
+
+		ResultSlot() : has_value(false) {}
+		~ResultSlot()
+		{
+			if (has_value)
+				value().~T();
+		}
+
+		template<class Fn>
+		void run(Fn& fn)
+		{
+			::new (&storage) T(fn());
+			has_value = true;
+		}
+
+		T& value() { return *reinterpret_cast<T*>(&storage); }
+		T take() { return std::move(value()); }
+
+		bool has_value;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	template<>
+	struct ResultSlot<void>
+	{
+		template<class Fn>
+		void run(Fn& fn) { fn(); }
+
+		void take() {}
+	};
+
+	// One finished task, allocated through the allocator hooks by the worker
+	// that ran it and released by the consumer
+	template<class T>
+	struct CompletionNode
+	{
+		std::atomic<CompletionNode*> next;
+		unsigned long long id;
+		std::exception_ptr error;
+		ResultSlot<T> result;
+	};
+
+	// Shared by a CompletionQueue and its submitted tasks. Workers append
+	// finished tasks to an intrusive MPSC queue (D. Vyukov's design, as in
+	// Strand): one exchange and one store, no lock. The consumer sleeps until
+	// wake_at results are ready; only the worker that completes the last of
+	// them takes the mutex to wake it, so a batch costs one wakeup.
+	template<class T>
+	class CompletionState
+	{
+	public:
+		typedef CompletionNode<T> Node;
+
+		explicit CompletionState(ThreadPool& pool)
+			: pool_(pool), head_(&stub_), ready_(0), wake_at_(0), tail_(&stub_), outstanding_(0)
+		{
+			stub_.next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		~CompletionState()
+		{
+			while (Node* node = pop())
+				release(node);
+		}
+
+		CompletionState(const CompletionState&) = delete;
+		CompletionState& operator=(const CompletionState&) = delete;
+
+		ThreadPool& pool() const { return pool_; }
+
+		static Node* create(unsigned long long id)
+		{
+			void* memory = allocate_block(sizeof(Node));
+			Node* node = ::new (memory) Node;
+			node->id = id;
+			return node;
+		}
+
+		static void release(Node* node)
+		{
+			node->~Node();
+			deallocate_block(node, sizeof(Node));
+		}
+
+		void submitted(size_t count) { outstanding_.fetch_add(count); }
+		void withdrawn(size_t count) { outstanding_.fetch_sub(count); }
+
+		// Worker side. Counted after it is linked, so the consumer never looks
+		// for more nodes than the queue will hold; seq_cst against wait() below.
+		void push(Node* node)
+		{
+			link(node);
+			const size_t ready = ready_.fetch_add(1) + 1;
+			size_t wanted = wake_at_.load();
+			if (wanted != 0 && ready >= wanted && wake_at_.compare_exchange_strong(wanted, 0))
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				cond_.notify_one();
+			}
+		}
+
+		size_t ready() const { return ready_.load(); }
+		size_t outstanding() const { return outstanding_.load(); }
+
+		// Consumer side: wait until min(count, outstanding) results are ready or
+		// deadline passes; returns how many are ready
+		size_t wait(size_t count, const std::chrono::steady_clock::time_point* deadline)
+		{
+			const size_t target = std::min(count, outstanding_.load());
+			size_t ready = ready_.load();
+			if (ready >= target)
+				return ready;
+			// Announce the target, then re-check: either we see the last push or
+			// its producer sees the target
+			wake_at_.store(target);
+			ready = ready_.load();
+			if (ready < target)
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				auto woken = [this] { return wake_at_.load() == 0; };
+				if (deadline)
+					cond_.wait_until(lock, *deadline, woken);
+				else
+					cond_.wait(lock, woken);
+			}
+			wake_at_.store(0);
+			return ready_.load();
+		}
+
+		// Up to max ready results, appended to out
+		size_t take(std::vector<Completion<T>>& out, size_t max)
+		{
+			const size_t count = std::min(max, ready_.load());
+			for (size_t i = 0; i < count; ++i)
+				out.push_back(Completion<T>(next()));
+			finish(count);
+			return count;
+		}
+
+		// One ready result (requires ready() > 0)
+		Node* take_one()
+		{
+			Node* node = next();
+			finish(1);
+			return node;
+		}
+
+	private:
+		void finish(size_t count)
+		{
+			ready_.fetch_sub(count);
+			outstanding_.fetch_sub(count);
+		}
+
+		// A counted node is linked, but one pushed before it by a worker that is
+		// halfway through link() still hides it for a moment
+		Node* next()
+		{
+			for (;;)
+			{
+				if (Node* node = pop())
+					return node;
+				std::this_thread::yield();
+			}
+		}
+
+		void link(Node* node)
+		{
+			node->next.store(nullptr, std::memory_order_relaxed);
+			Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		// Single consumer
+		Node* pop()
+		{
+			Node* tail = tail_;
+			Node* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &stub_)
+			{
+				if (!next)
+					return nullptr;
+				tail_ = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next)
+			{
+				tail_ = next;
+				return tail;
+			}
+			if (tail != head_.load(std::memory_order_acquire))
+				return nullptr;
+			// tail is the last node: put the stub behind it so it can be taken
+			link(&stub_);
+			next = tail->next.load(std::memory_order_acquire);
+			if (next)
+			{
+				tail_ = next;
+				return tail;
+			}
+			return nullptr;
+		}
+
+		ThreadPool& pool_;
+		Node stub_;
+		std::atomic<Node*> head_;  // Workers
+		std::atomic<size_t> ready_;  // Pushed, not yet taken
+		std::atomic<size_t> wake_at_;  // Consumer asleep until ready_ reaches it, 0: awake
+		char pad_[cache_line_size];
+		Node* tail_;  // Consumer
+		std::atomic<size_t> outstanding_;  // Submitted, not yet taken
+		std::mutex mutex_;
+		std::condition_variable cond_;
+	};
+
+	// Pool task of CompletionQueue::submit(): runs fn and queues its result.
+	// A task dropped unrun (cancelled, expired, shed) queues the error.
+	template<class T, class Fn>
+	struct CompletionCall
+	{
+		std::shared_ptr<CompletionState<T>> state;
+		unsigned long long id;
+		Fn fn;
+
+		void operator()()
+		{
+			CompletionNode<T>* node = CompletionState<T>::create(id);
+			try
+			{
+				node->result.run(fn);
+			}
+			catch (...)
+			{
+				node->error = std::current_exception();
+			}
+			state->push(node);
+		}
+	};
+
+	template<class T, class Fn>
+	void cancel_task(CompletionCall<T, Fn>& call, std::exception_ptr error)
+	{
+		CompletionNode<T>* node = CompletionState<T>::create(call.id);
+		node->error = error;
+		call.state->push(node);
+	}
+
+	// f(index) of CompletionQueue::submit_bulk(), one shared copy of f
+	template<class Fn>
+	struct BulkIndexCall
+	{
+		std::shared_ptr<Fn> fn;
+		size_t index;
+
+		auto operator()() -> decltype((*fn)(index)) { return (*fn)(index); }
+	};
+}
+
+// Result of one task of a CompletionQueue: the id it was submitted with and
+// its value or exception. Move-only; get() may be called once.
+template<class T>
+class Completion
+{
+public:
+	Completion() noexcept : node_(nullptr) {}
+	Completion(Completion&& other) noexcept : node_(other.node_) { other.node_ = nullptr; }
+
+	Completion& operator=(Completion&& other) noexcept
+	{
+		std::swap(node_, other.node_);
+		return *this;
+	}
+
+	Completion(const Completion&) = delete;
+	Completion& operator=(const Completion&) = delete;
+
+	~Completion()
+	{
+		if (node_)
+			thread_pool_detail::CompletionState<T>::release(node_);
+	}
+
+	bool valid() const noexcept { return node_ != nullptr; }
+
+	unsigned long long id() const { return node_->id; }
+
+	// The task threw, or was dropped without running (ThreadPool::TaskCancelled)
+	bool failed() const { return static_cast<bool>(node_->error); }
+
+	// The value, or rethrows the task's exception
+	T get()
+	{
+		if (node_->error)
+			std::rethrow_exception(node_->error);
+		return node_->result.take();
+	}
+
+private:
+	friend class thread_pool_detail::CompletionState<T>;
+	template<class U>
+	friend class CompletionQueue;
+
+	explicit Completion(thread_pool_detail::CompletionNode<T>* node) noexcept : node_(node) {}
+
+	thread_pool_detail::CompletionNode<T>* node_;
+};
+
+// Scatter-gather without a future per task: tasks submitted with an id
+// deliver their results into one queue, and a consumer takes them in
+// completion order, one or a batch at a time. Workers append without a lock;
+// a consumer waiting for a batch of n is woken once, by the worker that
+// completes the n-th result. Any thread may submit, one thread at a time may
+// consume. Results still queued or in flight when the queue is destroyed are
+// discarded.
+template<class T>
+class CompletionQueue
+{
+public:
+	explicit CompletionQueue(ThreadPool& pool)
+		: state_(thread_pool_detail::make_shared_state<thread_pool_detail::CompletionState<T>>(pool))
+	{
+	}
+
+	CompletionQueue(const CompletionQueue&) = delete;
+	CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+	ThreadPool& pool() const { return state_->pool(); }
+
+	// Run f(args...) on the pool; its result arrives tagged with id. Subject
+	// to the pool's admission control like post().
+	template<class F, class... Args>
+	auto submit(unsigned long long id, F&& f, Args&&... args)
+		-> typename thread_pool_detail::enable_if_callable<F>::type
+	{
+		submit(id, ThreadPool::TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+	}
+
+	// With per-task options; a task cancelled or expired before it runs
+	// delivers ThreadPool::TaskCancelled
+	template<class F, class... Args>
+	void submit(unsigned long long id, const ThreadPool::TaskOptions& options, F&& f, Args&&... args)
+	{
+		typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+		thread_pool_detail::CompletionCall<T, bound_type> call = {
+			state_, id, std::bind(std::forward<F>(f), std::forward<Args>(args)...) };
+		state_->submitted(1);
+		try
+		{
+			thread_pool_detail::pool_access::submit(pool(), options, std::move(call));
+		}
+		catch (...)
+		{
+			state_->withdrawn(1);
+			throw;
+		}
+	}
+
+	// f(i) for every i in [0, count), tagged first_id + i, with one queue lock
+	// and one round of wakeups in the pool
+	template<class F>
+	void submit_bulk(unsigned long long first_id, size_t count, F&& f)
+	{
+		typedef typename std::decay<F>::type fn_type;
+		typedef thread_pool_detail::BulkIndexCall<fn_type> bulk_type;
+
+		std::shared_ptr<fn_type> fn = thread_pool_detail::make_shared_state<fn_type>(std::forward<F>(f));
+		std::vector<thread_pool_detail::Task> batch;
+		batch.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			bulk_type bulk = { fn, i };
+			thread_pool_detail::CompletionCall<T, bulk_type> call = { state_, first_id + i, std::move(bulk) };
+			batch.emplace_back(std::move(call));
+		}
+		state_->submitted(count);
+		try
+		{
+			thread_pool_detail::pool_access::submit_bulk(pool(), batch);
+		}
+		catch (...)
+		{
+			state_->withdrawn(count);
+			throw;
+		}
+	}
+
+	// Take a ready result without waiting; false if there is none
+	bool try_pop(Completion<T>& out)
+	{
+		if (state_->ready() == 0)
+			return false;
+		out = Completion<T>(state_->take_one());
+		return true;
+	}
+
+	// Wait for the next result; false if no task is outstanding
+	bool pop(Completion<T>& out)
+	{
+		if (state_->wait(1, nullptr) == 0)
+			return false;
+		out = Completion<T>(state_->take_one());
+		return true;
+	}
+
+	// Wait until min_count results are ready (fewer if fewer are outstanding),
+	// then append up to max_count of those ready to out; returns how many
+	size_t pop_batch(std::vector<Completion<T>>& out, size_t min_count = 1, size_t max_count = static_cast<size_t>(-1))
+	{
+		state_->wait(min_count, nullptr);
+		return state_->take(out, max_count);
+	}
+
+	// pop_batch() that stops waiting after timeout, with whatever is ready then
+	template<class Rep, class Period>
+	size_t pop_batch_for(std::vector<Completion<T>>& out, std::chrono::duration<Rep, Period> timeout,
+		size_t min_count = 1, size_t max_count = static_cast<size_t>(-1))
+	{
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+			+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+		state_->wait(min_count, &deadline);
+		return state_->take(out, max_count);
+	}
+
+	// Submitted and not yet taken by the consumer
+	size_t outstanding() const { return state_->outstanding(); }
+
+	// Ready to be taken
+	size_t ready() const { return state_->ready(); }
+
+private:
+	std::shared_ptr<thread_pool_detail::CompletionState<T>> state_;
+};
+
+#endif
@@ -0,0 +1,249 @@
+﻿#ifndef THREAD_POOL_COROUTINE_H
+#define THREAD_POOL_COROUTINE_H
+
+#include "TaskGraph.h"
+
+#if !defined(THREAD_POOL_COROUTINES)
+#error "Coroutine.h needs C++20 coroutines (-std=c++20)"
+#endif
+
+#include <exception>
+#include <optional>
+
+template<class T = void>
+class CoTask;
+
+namespace thread_pool_detail
+{
+	// Resumes whoever awaited the finished coroutine by symmetric transfer, so
+	// chains of co_awaits run on one worker without going through the queue or
+	// growing the stack
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+
+		template<class Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	struct CoPromiseBase
+	{
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+		FinalAwaiter final_suspend() const noexcept { return {}; }
+		void unhandled_exception() noexcept { error = std::current_exception(); }
+
+		std::coroutine_handle<> continuation;
+		std::exception_ptr error;
+	};
+
+	template<class T>
+	struct CoPromise : CoPromiseBase
+	{
+		CoTask<T> get_return_object() noexcept;
+
+		template<class U>
+		void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+		T result()
+		{
+			if (error)
+				std::rethrow_exception(error);
+			return std::move(*value);
+		}
+
+		std::optional<T> value;
+	};
+
+	template<>
+	struct CoPromise<void> : CoPromiseBase
+	{
+		CoTask<void> get_return_object() noexcept;
+
+		void return_void() const noexcept {}
+
+		void result()
+		{
+			if (error)
+				std::rethrow_exception(error);
+		}
+	};
+
+	// Self-destroying coroutine driving a CoTask from co_spawn
+	struct Detached
+	{
+		struct promise_type
+		{
+			Detached get_return_object() const noexcept { return {}; }
+			std::suspend_never initial_suspend() const noexcept { return {}; }
+			std::suspend_never final_suspend() const noexcept { return {}; }
+			void return_void() const noexcept {}
+			void unhandled_exception() const noexcept { std::terminate(); }
+		};
+	};
+
+	template<class T>
+	Detached run_detached(ThreadPool& pool, CoTask<T> task, std::shared_ptr<FutureState<T>> state)
+	{
+		// Only the awaits are guarded: the state is set once, after the try
+		std::exception_ptr error;
+		std::optional<typename std::conditional<std::is_void<T>::value, char, T>::type> value;
+		try
+		{
+			// Throws here, on the spawning thread, if the pool is stopped
+			co_await pool.schedule();
+			if constexpr (std::is_void<T>::value)
+				co_await std::move(task);
+			else
+				value.emplace(co_await std::move(task));
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		if (error)
+			state->set_exception(error);
+		else if constexpr (std::is_void<T>::value)
+			state->set_value();
+		else
+			state->set_value(std::move(*value));
+	}
+
+	// Pool task resuming a coroutine whose awaited future is ready. Should the
+	// pool refuse it (stopped), the coroutine resumes on the thread that
+	// published the result instead of never.
+	struct ResumeTask
+	{
+		std::coroutine_handle<> handle;
+
+		void operator()() const { handle.resume(); }
+	};
+
+	inline void cancel_task(ResumeTask& task, std::exception_ptr) { task.handle.resume(); }
+
+	// co_await on a TaskFuture: the coroutine is resumed on the pool once the
+	// result is there, no thread waits for it
+	template<class T>
+	class FutureAwaiter
+	{
+	public:
+		explicit FutureAwaiter(const TaskFuture<T>& future) : future_(future) {}
+
+		bool await_ready() const { return future_.is_ready(); }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			future_access::state(future_)->on_ready(Task(ResumeTask{ handle }));
+		}
+
+		T await_resume() const { return future_.get(); }
+
+	private:
+		TaskFuture<T> future_;
+	};
+}
+
+// Lazily started coroutine returning T. Awaiting it from another coroutine
+// starts it on the awaiting thread and resumes the awaiter when it finishes;
+// co_await pool.schedule() inside moves it onto a worker. Start a top-level
+// CoTask with co_spawn().
+template<class T>
+class [[nodiscard]] CoTask
+{
+public:
+	typedef thread_pool_detail::CoPromise<T> promise_type;
+
+	CoTask() noexcept {}
+	CoTask(CoTask&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+
+	CoTask& operator=(CoTask&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (handle_)
+				handle_.destroy();
+			handle_ = other.handle_;
+			other.handle_ = nullptr;
+		}
+		return *this;
+	}
+
+	CoTask(const CoTask&) = delete;
+	CoTask& operator=(const CoTask&) = delete;
+
+	~CoTask()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool valid() const noexcept { return static_cast<bool>(handle_); }
+
+	class Awaiter
+	{
+	public:
+		explicit Awaiter(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+		bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+		// Symmetric transfer into the awaited coroutine
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+		{
+			handle_.promise().continuation = awaiting;
+			return handle_;
+		}
+
+		T await_resume() { return handle_.promise().result(); }
+
+	private:
+		std::coroutine_handle<promise_type> handle_;
+	};
+
+	Awaiter operator co_await() && noexcept { return Awaiter(handle_); }
+	Awaiter operator co_await() & noexcept { return Awaiter(handle_); }
+
+private:
+	friend struct thread_pool_detail::CoPromise<T>;
+
+	explicit CoTask(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace thread_pool_detail
+{
+	template<class T>
+	CoTask<T> CoPromise<T>::get_return_object() noexcept
+	{
+		return CoTask<T>(std::coroutine_handle<CoPromise<T>>::from_promise(*this));
+	}
+
+	inline CoTask<void> CoPromise<void>::get_return_object() noexcept
+	{
+		return CoTask<void>(std::coroutine_handle<CoPromise<void>>::from_promise(*this));
+	}
+}
+
+// Start a coroutine on a pool worker. The returned future is chainable with
+// then() and can itself be co_awaited.
+template<class T>
+TaskFuture<T> co_spawn(ThreadPool& pool, CoTask<T> task)
+{
+	std::shared_ptr<thread_pool_detail::FutureState<T>> state =
+		thread_pool_detail::make_shared_state<thread_pool_detail::FutureState<T>>(pool);
+	thread_pool_detail::run_detached(pool, std::move(task), state);
+	return thread_pool_detail::future_access::make(state);
+}
+
+template<class T>
+thread_pool_detail::FutureAwaiter<T> operator co_await(const TaskFuture<T>& future)
+{
+	return thread_pool_detail::FutureAwaiter<T>(future);
+}
+
+#endif
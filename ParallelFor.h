@@ -0,0 +1,332 @@
+﻿#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include "ThreadPool.h"
+
+// Range splitting strategy for parallel_for / parallel_reduce
+enum class Partitioner
+{
+	STATIC,  // One equal block per participant
+	GUIDED,  // Chunks shrink with the remaining work, never below grain
+	AUTO     // Lazy splitting: a range is halved only while workers are idle
+};
+
+namespace thread_pool_detail
+{
+	// State shared by the participants of one parallel loop. The calling thread
+	// takes part and waits until every iteration has been accounted for; helpers
+	// that start late find nothing left to claim and never touch the job.
+	//
+	// Job interface:
+	//   participant_type participant();                      // per-thread state
+	//   void run(participant_type&, size_t first, size_t last);  // offsets [first, last)
+	//   void merge(participant_type&);                       // fold per-thread state back
+	template<class Job>
+	class ParallelLoop : public std::enable_shared_from_this<ParallelLoop<Job>>
+	{
+	public:
+		ParallelLoop(ThreadPool& pool, Job& job, size_t total, size_t grain, Partitioner partitioner)
+			: pool_(pool), job_(&job), total_(total), grain_(grain), partitioner_(partitioner),
+			blocks_(1), block_size_(total), next_(0), remaining_(total), failed_(false),
+			pending_helpers_(0)
+		{
+		}
+
+		void run()
+		{
+			size_t helpers = pool_.size() - (pool_.is_worker_thread() ? 1 : 0);
+			if (partitioner_ == Partitioner::AUTO)
+			{
+				ranges_.push_back(std::make_pair(size_t(0), total_));
+				helpers = 0;  // Helpers are posted on demand while splitting
+			}
+			else
+			{
+				helpers = std::min(helpers, (total_ + grain_ - 1) / grain_ - 1);
+				if (partitioner_ == Partitioner::STATIC)
+				{
+					blocks_ = helpers + 1;
+					block_size_ = (total_ + blocks_ - 1) / blocks_;
+				}
+			}
+
+			for (size_t i = 0; i < helpers; ++i)
+				post_helper();
+			participate();
+
+			{
+				std::unique_lock<std::mutex> lock(done_mutex_);
+				done_cond_.wait(lock, [this] { return remaining_ == 0; });
+			}
+			if (error_)
+				std::rethrow_exception(error_);
+		}
+
+	private:
+		typedef typename Job::participant_type participant_type;
+
+		void post_helper()
+		{
+			std::shared_ptr<ParallelLoop> self = this->shared_from_this();
+			pending_helpers_++;
+			pool_access::post(pool_, [self] { self->pending_helpers_--; self->participate(); });
+		}
+
+		void participate()
+		{
+			size_t first, last;
+			if (!claim(first, last))
+				return;
+
+			participant_type participant = job_->participant();
+			size_t done = 0;
+			do
+			{
+				if (partitioner_ == Partitioner::AUTO)
+				{
+					while (last - first > grain_)
+					{
+						// Hand half of the range to a worker that ran dry
+						if (last - first >= 2 * grain_ && !failed_
+							&& pool_.idle_workers() > pending_helpers_)
+						{
+							size_t middle = first + (last - first) / 2;
+							{
+								std::lock_guard<std::mutex> lock(ranges_mutex_);
+								ranges_.push_back(std::make_pair(middle, last));
+							}
+							post_helper();
+							last = middle;
+							continue;
+						}
+						execute(participant, first, first + grain_);
+						done += grain_;
+						first += grain_;
+					}
+				}
+				execute(participant, first, last);
+				done += last - first;
+			} while (claim(first, last));
+
+			if (!failed_)
+			{
+				try
+				{
+					job_->merge(participant);
+				}
+				catch (...)
+				{
+					set_error(std::current_exception());
+				}
+			}
+			complete(done);
+		}
+
+		bool claim(size_t& first, size_t& last)
+		{
+			switch (partitioner_)
+			{
+			case Partitioner::STATIC:
+			{
+				size_t block = next_.fetch_add(1);
+				if (block >= blocks_)
+					return false;
+				first = block * block_size_;
+				last = std::min(total_, first + block_size_);
+				return first < last;
+			}
+			case Partitioner::GUIDED:
+			{
+				size_t current = next_.load();
+				for (;;)
+				{
+					if (current >= total_)
+						return false;
+					size_t chunk = std::max(grain_, (total_ - current) / (2 * (pool_.size() + 1)));
+					size_t end = std::min(total_, current + chunk);
+					if (next_.compare_exchange_weak(current, end))
+					{
+						first = current;
+						last = end;
+						return true;
+					}
+				}
+			}
+			default:
+			{
+				std::lock_guard<std::mutex> lock(ranges_mutex_);
+				if (ranges_.empty())
+					return false;
+				first = ranges_.back().first;
+				last = ranges_.back().second;
+				ranges_.pop_back();
+				return true;
+			}
+			}
+		}
+
+		void execute(participant_type& participant, size_t first, size_t last)
+		{
+			if (failed_)
+				return;
+			try
+			{
+				job_->run(participant, first, last);
+			}
+			catch (...)
+			{
+				set_error(std::current_exception());
+			}
+		}
+
+		void set_error(std::exception_ptr error)
+		{
+			std::lock_guard<std::mutex> lock(done_mutex_);
+			if (!error_)
+				error_ = error;
+			failed_ = true;
+		}
+
+		// Iterations are only reported after merge(), so the caller cannot return
+		// while a participant still uses the job
+		void complete(size_t count)
+		{
+			if (remaining_.fetch_sub(count) == count)
+			{
+				std::lock_guard<std::mutex> lock(done_mutex_);
+				done_cond_.notify_all();
+			}
+		}
+
+		ThreadPool& pool_;
+		Job* job_;
+		const size_t total_;
+		const size_t grain_;
+		const Partitioner partitioner_;
+		size_t blocks_;
+		size_t block_size_;
+
+		std::atomic<size_t> next_;
+		std::atomic<size_t> remaining_;
+		std::atomic<bool> failed_;
+		std::atomic<size_t> pending_helpers_;
+
+		std::mutex ranges_mutex_;
+		std::vector<std::pair<size_t, size_t>> ranges_;
+
+		std::mutex done_mutex_;
+		std::condition_variable done_cond_;
+		std::exception_ptr error_;
+	};
+
+	template<class Index, class F>
+	struct ForJob
+	{
+		struct participant_type {};
+
+		Index begin;
+		F* fn;
+
+		participant_type participant() { return participant_type(); }
+
+		void run(participant_type&, size_t first, size_t last)
+		{
+			for (size_t i = first; i < last; ++i)
+				(*fn)(static_cast<Index>(begin + static_cast<Index>(i)));
+		}
+
+		void merge(participant_type&) {}
+	};
+
+	template<class Index, class T, class Body, class Combine>
+	struct ReduceJob
+	{
+		struct participant_type
+		{
+			T value;
+		};
+
+		Index begin;
+		Body* body;
+		Combine* combine;
+		const T* identity;
+		T result;
+		std::mutex mutex;
+
+		ReduceJob(Index b, Body* bd, Combine* c, const T& init)
+			: begin(b), body(bd), combine(c), identity(&init), result(init)
+		{
+		}
+
+		participant_type participant()
+		{
+			participant_type participant = { *identity };
+			return participant;
+		}
+
+		void run(participant_type& participant, size_t first, size_t last)
+		{
+			participant.value = (*body)(static_cast<Index>(begin + static_cast<Index>(first)),
+				static_cast<Index>(begin + static_cast<Index>(last)), std::move(participant.value));
+		}
+
+		void merge(participant_type& participant)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			result = (*combine)(std::move(result), std::move(participant.value));
+		}
+	};
+
+	template<class Index>
+	size_t loop_grain(const ThreadPool& pool, size_t total, Index grain)
+	{
+		if (grain > 0)
+			return static_cast<size_t>(grain);
+		// Default: about eight chunks per participant
+		return std::max(size_t(1), total / (8 * (pool.size() + 1)));
+	}
+
+	template<class Job>
+	void run_loop(ThreadPool& pool, Job& job, size_t total, size_t grain, Partitioner partitioner)
+	{
+		std::make_shared<ParallelLoop<Job>>(pool, job, total, grain, partitioner)->run();
+	}
+}
+
+// Call fn(i) for every i in [begin, end) on the pool. The calling thread takes
+// part in the loop instead of blocking; grain is the smallest chunk of
+// iterations handed out at once (0 picks one). The first exception thrown by fn
+// is rethrown once the loop has finished.
+template<class Index, class F>
+void parallel_for(ThreadPool& pool, Index begin, Index end, Index grain, F&& fn,
+	Partitioner partitioner = Partitioner::AUTO)
+{
+	if (!(begin < end))
+		return;
+	typedef typename std::remove_reference<F>::type fn_type;
+	const size_t total = static_cast<size_t>(end - begin);
+	thread_pool_detail::ForJob<Index, fn_type> job = { begin, &fn };
+	thread_pool_detail::run_loop(pool, job, total,
+		thread_pool_detail::loop_grain(pool, total, grain), partitioner);
+}
+
+// Reduce [begin, end): every participant folds its chunks with
+// body(first, last, accumulated) -> T starting from identity, and the partial
+// results are folded with combine(T, T) -> T. combine must be associative and
+// commutative, partial results are combined in completion order.
+template<class Index, class T, class Body, class Combine>
+T parallel_reduce(ThreadPool& pool, Index begin, Index end, Index grain, const T& identity,
+	Body&& body, Combine&& combine, Partitioner partitioner = Partitioner::AUTO)
+{
+	if (!(begin < end))
+		return identity;
+	typedef typename std::remove_reference<Body>::type body_type;
+	typedef typename std::remove_reference<Combine>::type combine_type;
+	const size_t total = static_cast<size_t>(end - begin);
+	thread_pool_detail::ReduceJob<Index, T, body_type, combine_type> job(begin, &body, &combine, identity);
+	thread_pool_detail::run_loop(pool, job, total,
+		thread_pool_detail::loop_grain(pool, total, grain), partitioner);
+	return std::move(job.result);
+}
+
+#endif
@@ -0,0 +1,204 @@
+﻿#ifndef STRAND_H
+#define STRAND_H
+
+#include "ThreadPool.h"
+
+namespace thread_pool_detail
+{
+	// Node of the strand queue, allocated through the allocator hooks
+	struct StrandNode
+	{
+		std::atomic<StrandNode*> next;
+		Task task;
+	};
+
+	// Shared by a Strand and the runner task it has on the pool. Producers
+	// append to an intrusive MPSC queue (D. Vyukov's design): one exchange and
+	// one store, no lock. pending counts queued tasks; the producer that takes
+	// it from zero posts the runner, so at most one runner exists and the
+	// strand's tasks never overlap.
+	class StrandState : public std::enable_shared_from_this<StrandState>
+	{
+	public:
+		StrandState(ThreadPool& pool, size_t max_batch)
+			: pool_(pool), max_batch_(max_batch > 0 ? max_batch : 1), head_(&stub_), tail_(&stub_), pending_(0)
+		{
+			stub_.next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		~StrandState()
+		{
+			// Only left over if posting the runner failed (stopped pool)
+			while (StrandNode* node = pop())
+				release(node);
+		}
+
+		StrandState(const StrandState&) = delete;
+		StrandState& operator=(const StrandState&) = delete;
+
+		ThreadPool& pool() const { return pool_; }
+
+		void push(Task&& task)
+		{
+			void* memory = allocate_block(sizeof(StrandNode));
+			StrandNode* node = ::new (memory) StrandNode;
+			node->task = std::move(task);
+			// Counted before it is linked, so the runner never takes more than pending
+			const bool idle = pending_.fetch_add(1, std::memory_order_acq_rel) == 0;
+			link(node);
+			if (idle)
+				schedule();
+		}
+
+		bool running_here() const { return current() == this; }
+
+		// Runner: up to max_batch tasks in a row on this worker, then back into
+		// the pool queue so other work (and other strands) get their turn
+		void run()
+		{
+			const StrandState* outer = current();
+			current() = this;
+			size_t done = 0;
+			while (done < max_batch_)
+			{
+				StrandNode* node = pop();
+				if (!node)
+					break;  // Empty, or a producer is halfway through push()
+				try
+				{
+					node->task();
+				}
+				catch (...)
+				{
+					pool_access::handle_exception(pool_, std::current_exception());
+				}
+				release(node);
+				++done;
+			}
+			current() = outer;
+			if (pending_.fetch_sub(done, std::memory_order_acq_rel) != done)
+				schedule();
+		}
+
+	private:
+		struct Runner
+		{
+			std::shared_ptr<StrandState> state;
+
+			void operator()() { state->run(); }
+		};
+
+		static const StrandState*& current()
+		{
+			static thread_local const StrandState* state = nullptr;
+			return state;
+		}
+
+		void schedule()
+		{
+			Runner runner = { shared_from_this() };
+			pool_access::post(pool_, std::move(runner));
+		}
+
+		void link(StrandNode* node)
+		{
+			node->next.store(nullptr, std::memory_order_relaxed);
+			StrandNode* prev = head_.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		// Single consumer: only the runner (or the destructor) pops
+		StrandNode* pop()
+		{
+			StrandNode* tail = tail_;
+			StrandNode* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &stub_)
+			{
+				if (!next)
+					return nullptr;
+				tail_ = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next)
+			{
+				tail_ = next;
+				return tail;
+			}
+			if (tail != head_.load(std::memory_order_acquire))
+				return nullptr;
+			// tail is the last node: put the stub behind it so it can be taken
+			link(&stub_);
+			next = tail->next.load(std::memory_order_acquire);
+			if (next)
+			{
+				tail_ = next;
+				return tail;
+			}
+			return nullptr;
+		}
+
+		static void release(StrandNode* node)
+		{
+			node->~StrandNode();
+			deallocate_block(node, sizeof(StrandNode));
+		}
+
+		ThreadPool& pool_;
+		const size_t max_batch_;
+		StrandNode stub_;
+		std::atomic<StrandNode*> head_;  // Producers
+		char pad_[cache_line_size];
+		StrandNode* tail_;               // Runner
+		std::atomic<size_t> pending_;
+	};
+}
+
+// Serial executor on a ThreadPool: tasks posted to one strand run one at a
+// time in FIFO order, on whichever worker is free, without a thread of their
+// own. Strands need no locking in the tasks that share their state. A worker
+// visiting a strand runs up to max_batch of its tasks back to back before
+// putting it back in the pool queue. Tasks still queued when the Strand is
+// destroyed are run all the same.
+class Strand
+{
+public:
+	explicit Strand(ThreadPool& pool, size_t max_batch = 16)
+		: state_(thread_pool_detail::make_shared_state<thread_pool_detail::StrandState>(pool, max_batch))
+	{
+	}
+
+	Strand(const Strand&) = delete;
+	Strand& operator=(const Strand&) = delete;
+
+	ThreadPool& pool() const { return state_->pool(); }
+
+	// True while the calling thread runs one of this strand's tasks
+	bool running_in_this_thread() const { return state_->running_here(); }
+
+	// Fire-and-forget: exceptions go to the pool's exception handler
+	template<class F, class... Args>
+	void post(F&& f, Args&&... args)
+	{
+		state_->push(thread_pool_detail::Task(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+	}
+
+	template<class F, class... Args>
+	auto enqueue(F&& f, Args&&... args)
+		-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>
+	{
+		using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+		typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+		thread_pool_detail::PromiseTask<return_type, bound_type> task(
+			std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+		std::future<return_type> result = task.promise.get_future();
+		state_->push(thread_pool_detail::Task(std::move(task)));
+		return result;
+	}
+
+private:
+	std::shared_ptr<thread_pool_detail::StrandState> state_;
+};
+
+#endif
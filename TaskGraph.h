@@ -0,0 +1,747 @@
+﻿#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include "ThreadPool.h"
+
+template<class T>
+class TaskFuture;
+
+namespace thread_pool_detail
+{
+	template<class T>
+	struct FutureValue
+	{
+		std::unique_ptr<T> value;
+
+		template<class U>
+		void set(U&& v) { value.reset(new T(std::forward<U>(v))); }
+		const T& get() const { return *value; }
+	};
+
+	template<>
+	struct FutureValue<void>
+	{
+		void set() {}
+		void get() const {}
+	};
+
+	// Shared state of a TaskFuture. Continuations are collected until the result
+	// is published and then posted to the pool, so nothing ever blocks a worker.
+	// A result is set once: a second one throws std::future_error
+	// (promise_already_satisfied), as std::promise does.
+	template<class T>
+	struct FutureState
+	{
+		explicit FutureState(ThreadPool& p) : pool(&p), ready(false) {}
+
+		template<class... V>
+		void set_value(V&&... v)
+		{
+			std::vector<Task> pending;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				check_unset();
+				value.set(std::forward<V>(v)...);
+				publish(pending);
+			}
+			post_all(pending);
+		}
+
+		void set_exception(std::exception_ptr e)
+		{
+			std::vector<Task> pending;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				check_unset();
+				error = e;
+				publish(pending);
+			}
+			post_all(pending);
+		}
+
+		// Run fn on the pool once the result is there (right away if it already is)
+		void on_ready(Task&& fn)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!ready)
+				{
+					continuations.push_back(std::move(fn));
+					return;
+				}
+			}
+			pool_access::post(*pool, std::move(fn));
+		}
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [this] { return ready; });
+		}
+
+		template<class Rep, class Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			return cond.wait_for(lock, timeout, [this] { return ready; });
+		}
+
+		ThreadPool* pool;
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool ready;
+		FutureValue<T> value;
+		std::exception_ptr error;
+		std::vector<Task> continuations;
+
+	private:
+		// mutex held
+		void check_unset() const
+		{
+			if (ready)
+				throw std::future_error(std::future_errc::promise_already_satisfied);
+		}
+
+		// mutex held, in the same critical section that stored the value or error
+		void publish(std::vector<Task>& pending)
+		{
+			ready = true;
+			pending.swap(continuations);
+			cond.notify_all();
+		}
+
+		// Outside the lock: posting may block on a full pool. A continuation the
+		// pool refuses (stopped) is cancelled with that error, which completes
+		// the state it feeds; this state keeps its result.
+		void post_all(std::vector<Task>& pending) noexcept
+		{
+			for (Task& fn : pending)
+			{
+				try
+				{
+					pool_access::post(*pool, std::move(fn));
+				}
+				catch (...)
+				{
+					fn.cancel(std::current_exception());
+				}
+			}
+		}
+	};
+
+	// Result type of a continuation: f(const T&), or f() for TaskFuture<void>
+	template<class F, class T>
+	struct continuation_result
+	{
+		typedef typename invoke_result<F, const T&>::type type;
+	};
+
+	template<class F>
+	struct continuation_result<F, void>
+	{
+		typedef typename invoke_result<F>::type type;
+	};
+
+	// Store the result of fn(args...) (or the exception it throws) in a state
+	template<class R>
+	struct fulfill_state
+	{
+		template<class Fn, class... Args>
+		static void call(FutureState<R>& state, Fn& fn, Args&&... args)
+		{
+			try
+			{
+				state.set_value(fn(std::forward<Args>(args)...));
+			}
+			catch (...)
+			{
+				state.set_exception(std::current_exception());
+			}
+		}
+	};
+
+	template<>
+	struct fulfill_state<void>
+	{
+		template<class Fn, class... Args>
+		static void call(FutureState<void>& state, Fn& fn, Args&&... args)
+		{
+			try
+			{
+				fn(std::forward<Args>(args)...);
+			}
+			catch (...)
+			{
+				state.set_exception(std::current_exception());
+				return;
+			}
+			state.set_value();
+		}
+	};
+
+	// Pool task running a callable into a fresh state
+	template<class R, class Fn>
+	struct AsyncTask
+	{
+		std::shared_ptr<FutureState<R>> state;
+		Fn fn;
+
+		void operator()() { fulfill_state<R>::call(*state, fn); }
+	};
+
+	// Pool task running a continuation once its source is ready. Errors of the
+	// source skip the continuation and propagate to its future.
+	template<class T, class R, class Fn>
+	struct Continuation
+	{
+		std::shared_ptr<FutureState<T>> source;
+		std::shared_ptr<FutureState<R>> target;
+		Fn fn;
+
+		void operator()()
+		{
+			if (source->error)
+				target->set_exception(source->error);
+			else
+				invoke(std::is_void<T>());
+		}
+
+	private:
+		void invoke(std::true_type) { fulfill_state<R>::call(*target, fn); }
+		void invoke(std::false_type) { fulfill_state<R>::call(*target, fn, source->value.get()); }
+	};
+
+	template<class T, class R, class Fn>
+	void cancel_task(Continuation<T, R, Fn>& continuation, std::exception_ptr error)
+	{
+		continuation.target->set_exception(error);
+	}
+
+	// Completes when all inputs are ready: collects their values in order, or
+	// the first error seen
+	template<class T>
+	struct WhenAllState
+	{
+		WhenAllState(ThreadPool& pool, size_t count) : result(new FutureState<std::vector<T>>(pool)),
+			values(count), remaining(count) {}
+
+		std::shared_ptr<FutureState<std::vector<T>>> result;
+		std::vector<T> values;
+		std::atomic<size_t> remaining;
+		std::mutex mutex;
+		std::exception_ptr error;
+
+		void arrive(size_t index, const std::shared_ptr<FutureState<T>>& input)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (input->error)
+				{
+					if (!error)
+						error = input->error;
+				}
+				else
+				{
+					values[index] = input->value.get();
+				}
+			}
+			if (remaining.fetch_sub(1) == 1)
+				finish();
+		}
+
+		// An arrival that could not be posted
+		void fail(std::exception_ptr e)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = e;
+			}
+			if (remaining.fetch_sub(1) == 1)
+				finish();
+		}
+
+		void finish()
+		{
+			if (error)
+				result->set_exception(error);
+			else
+				result->set_value(std::move(values));
+		}
+	};
+
+	template<>
+	struct WhenAllState<void>
+	{
+		WhenAllState(ThreadPool& pool, size_t count) : result(new FutureState<void>(pool)), remaining(count) {}
+
+		std::shared_ptr<FutureState<void>> result;
+		std::atomic<size_t> remaining;
+		std::mutex mutex;
+		std::exception_ptr error;
+
+		void arrive(size_t, const std::shared_ptr<FutureState<void>>& input)
+		{
+			if (input->error)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = input->error;
+			}
+			if (remaining.fetch_sub(1) == 1)
+				finish();
+		}
+
+		void fail(std::exception_ptr e)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = e;
+			}
+			if (remaining.fetch_sub(1) == 1)
+				finish();
+		}
+
+		void finish()
+		{
+			if (error)
+				result->set_exception(error);
+			else
+				result->set_value();
+		}
+	};
+
+	template<class T>
+	struct WhenAllArrival
+	{
+		std::shared_ptr<WhenAllState<T>> state;
+		std::shared_ptr<FutureState<T>> input;
+		size_t index;
+
+		void operator()() { state->arrive(index, input); }
+	};
+
+	template<class T>
+	void cancel_task(WhenAllArrival<T>& arrival, std::exception_ptr error) { arrival.state->fail(error); }
+
+	// Completes with the index of the first input to become ready
+	struct WhenAnyState
+	{
+		explicit WhenAnyState(ThreadPool& pool) : result(new FutureState<size_t>(pool)), done(false) {}
+
+		std::shared_ptr<FutureState<size_t>> result;
+		std::atomic<bool> done;
+	};
+
+	struct WhenAnyArrival
+	{
+		std::shared_ptr<WhenAnyState> state;
+		size_t index;
+
+		void operator()()
+		{
+			if (!state->done.exchange(true))
+				state->result->set_value(index);
+		}
+	};
+
+	inline void cancel_task(WhenAnyArrival& arrival, std::exception_ptr error)
+	{
+		if (!arrival.state->done.exchange(true))
+			arrival.state->result->set_exception(error);
+	}
+
+	template<class T>
+	struct when_all_result
+	{
+		typedef std::vector<T> type;
+	};
+
+	template<>
+	struct when_all_result<void>
+	{
+		typedef void type;
+	};
+
+	// Value type of a TaskFuture
+	template<class F>
+	struct future_value;
+
+	template<class T>
+	struct future_value<TaskFuture<T>>
+	{
+		typedef T type;
+	};
+
+	template<class T>
+	struct future_get
+	{
+		typedef const T& type;
+	};
+
+	template<>
+	struct future_get<void>
+	{
+		typedef void type;
+	};
+
+	// Access to the shared state of TaskFuture for the combinators
+	struct future_access
+	{
+		template<class T>
+		static const std::shared_ptr<FutureState<T>>& state(const TaskFuture<T>& future) { return future.state_; }
+
+		template<class T>
+		static TaskFuture<T> make(const std::shared_ptr<FutureState<T>>& state) { return TaskFuture<T>(state); }
+	};
+}
+
+// Future bound to a ThreadPool. Unlike std::future it can be chained: then()
+// schedules the continuation on the pool once the value is there, instead of a
+// worker blocking in get(). Copies share the same result.
+template<class T>
+class TaskFuture
+{
+public:
+	TaskFuture() {}
+
+	bool valid() const { return state_ != nullptr; }
+
+	bool is_ready() const
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+		return state_->ready;
+	}
+
+	// Block until the result is there. Avoid on worker threads, prefer then().
+	void wait() const { state_->wait(); }
+
+	// Wait at most timeout; like std::future (ThreadPool::wait() helps instead)
+	template<class Rep, class Period>
+	std::future_status wait_for(const std::chrono::duration<Rep, Period>& timeout) const
+	{
+		return state_->wait_for(timeout) ? std::future_status::ready : std::future_status::timeout;
+	}
+
+	// Wait for the result; rethrows the exception of a failed task
+	typename thread_pool_detail::future_get<T>::type get() const
+	{
+		state_->wait();
+		if (state_->error)
+			std::rethrow_exception(state_->error);
+		return state_->value.get();
+	}
+
+	// Run f(value) (f() for TaskFuture<void>) on the pool once this future is
+	// ready. If this future failed, f is skipped and the returned future
+	// carries the same exception.
+	template<class F>
+	TaskFuture<typename thread_pool_detail::continuation_result<typename std::decay<F>::type, T>::type>
+		then(F&& f) const
+	{
+		typedef typename std::decay<F>::type fn_type;
+		typedef typename thread_pool_detail::continuation_result<fn_type, T>::type result_type;
+		std::shared_ptr<thread_pool_detail::FutureState<result_type>> next =
+			thread_pool_detail::make_shared_state<thread_pool_detail::FutureState<result_type>>(*state_->pool);
+		thread_pool_detail::Continuation<T, result_type, fn_type> continuation =
+			{ state_, next, fn_type(std::forward<F>(f)) };
+		state_->on_ready(thread_pool_detail::Task(std::move(continuation)));
+		return thread_pool_detail::future_access::make(next);
+	}
+
+	ThreadPool& pool() const { return *state_->pool; }
+
+private:
+	friend struct thread_pool_detail::future_access;
+
+	explicit TaskFuture(const std::shared_ptr<thread_pool_detail::FutureState<T>>& state) : state_(state) {}
+
+	std::shared_ptr<thread_pool_detail::FutureState<T>> state_;
+};
+
+// Producer side of a TaskFuture, for results that come from outside the pool
+// (I/O callbacks, other threads). Continuations still run on the pool.
+template<class T>
+class TaskPromise
+{
+public:
+	explicit TaskPromise(ThreadPool& pool)
+		: state_(thread_pool_detail::make_shared_state<thread_pool_detail::FutureState<T>>(pool)) {}
+
+	TaskFuture<T> get_future() const { return thread_pool_detail::future_access::make(state_); }
+
+	template<class... V>
+	void set_value(V&&... v) { state_->set_value(std::forward<V>(v)...); }
+
+	void set_exception(std::exception_ptr e) { state_->set_exception(e); }
+
+private:
+	std::shared_ptr<thread_pool_detail::FutureState<T>> state_;
+};
+
+// Run f(args...) on the pool and return a chainable future for its result
+template<class F, class... Args>
+TaskFuture<typename thread_pool_detail::invoke_result<
+	typename std::decay<F>::type, typename std::decay<Args>::type...>::type>
+	async_task(ThreadPool& pool, F&& f, Args&&... args)
+{
+	typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) fn_type;
+	typedef typename thread_pool_detail::invoke_result<
+		typename std::decay<F>::type, typename std::decay<Args>::type...>::type result_type;
+	std::shared_ptr<thread_pool_detail::FutureState<result_type>> state =
+		thread_pool_detail::make_shared_state<thread_pool_detail::FutureState<result_type>>(pool);
+	thread_pool_detail::AsyncTask<result_type, fn_type> task =
+		{ state, std::bind(std::forward<F>(f), std::forward<Args>(args)...) };
+	thread_pool_detail::pool_access::post(pool, std::move(task));
+	return thread_pool_detail::future_access::make(state);
+}
+
+// Dependency graph of void tasks. Build once with add() and precede(), then
+// run() it any number of times: each task starts on the pool as soon as all
+// of its predecessors have finished, without a worker waiting for them.
+class TaskGraph
+{
+public:
+	typedef size_t Node;
+
+	// Add a task, optionally after the given predecessors
+	template<class F>
+	Node add(F&& fn);
+	template<class F>
+	Node add(F&& fn, std::initializer_list<Node> after);
+
+	// before must finish before after starts
+	void precede(Node before, Node after);
+
+	size_t size() const { return nodes_.size(); }
+
+	// Launch the graph. The future fails with the first exception thrown by a
+	// task; the tasks depending on a failed one, directly or not, are skipped,
+	// independent branches still run. Throws std::logic_error if the graph has
+	// a cycle.
+	TaskFuture<void> run(ThreadPool& pool) const;
+
+private:
+	struct NodeData
+	{
+		std::function<void()> fn;
+		std::vector<Node> successors;
+		size_t predecessors;
+	};
+
+	struct Run;
+
+	std::vector<NodeData> nodes_;
+};
+
+// Future of all futures in [first, last): a vector of their values in input order
+// (void for TaskFuture<void> inputs), or the first exception once all are done
+template<class InputIt>
+TaskFuture<typename thread_pool_detail::when_all_result<typename thread_pool_detail::future_value<
+	typename std::iterator_traits<InputIt>::value_type>::type>::type>
+	when_all(ThreadPool& pool, InputIt first, InputIt last)
+{
+	typedef typename thread_pool_detail::future_value<
+		typename std::iterator_traits<InputIt>::value_type>::type value_type;
+	typedef thread_pool_detail::future_access access;
+	const std::vector<TaskFuture<value_type>> inputs(first, last);
+
+	std::shared_ptr<thread_pool_detail::WhenAllState<value_type>> state =
+		thread_pool_detail::make_shared_state<thread_pool_detail::WhenAllState<value_type>>(pool, inputs.size());
+	if (inputs.empty())
+		state->finish();
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		thread_pool_detail::WhenAllArrival<value_type> arrival = { state, access::state(inputs[i]), i };
+		access::state(inputs[i])->on_ready(thread_pool_detail::Task(std::move(arrival)));
+	}
+	return access::make(state->result);
+}
+
+// Future of the index of the first future in [first, last) to become ready
+// (failed or not); the value is taken from that input
+template<class InputIt>
+TaskFuture<size_t> when_any(ThreadPool& pool, InputIt first, InputIt last)
+{
+	typedef thread_pool_detail::future_access access;
+	std::shared_ptr<thread_pool_detail::WhenAnyState> state =
+		thread_pool_detail::make_shared_state<thread_pool_detail::WhenAnyState>(pool);
+	size_t index = 0;
+	for (; first != last; ++first, ++index)
+	{
+		thread_pool_detail::WhenAnyArrival arrival = { state, index };
+		access::state(*first)->on_ready(thread_pool_detail::Task(arrival));
+	}
+	if (index == 0)
+		state->result->set_exception(std::make_exception_ptr(std::invalid_argument("when_any: no futures")));
+	return access::make(state->result);
+}
+
+// Per-run state: the graph is copied so it may change or go away while running
+struct TaskGraph::Run : std::enable_shared_from_this<TaskGraph::Run>
+{
+	Run(ThreadPool& p, const std::vector<NodeData>& n)
+		: pool(p), nodes(n), pending(new std::atomic<size_t>[n.size()]), skipped(new std::atomic<bool>[n.size()]),
+		remaining(n.size()), done(thread_pool_detail::make_shared_state<thread_pool_detail::FutureState<void>>(p))
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			pending[i] = nodes[i].predecessors;
+			skipped[i] = false;
+		}
+	}
+
+	struct Step
+	{
+		std::shared_ptr<Run> run;
+		Node node;
+
+		void operator()() { run->execute(node); }
+	};
+
+	void start(Node node)
+	{
+		Step step = { shared_from_this(), node };
+		try
+		{
+			thread_pool_detail::pool_access::post(pool, step);
+		}
+		catch (...)
+		{
+			// The pool refused the node (stopped): the run fails with that error,
+			// and the skipped node is accounted for here so done still completes
+			fail(std::current_exception());
+			skipped[node] = true;
+			execute(node);
+		}
+	}
+
+	void execute(Node node)
+	{
+		for (;;)
+		{
+			bool skip = skipped[node];
+			if (!skip)
+			{
+				try
+				{
+					nodes[node].fn();
+				}
+				catch (...)
+				{
+					fail(std::current_exception());
+					skip = true;
+				}
+			}
+
+			// The last successor that became ready runs inline, saving a round
+			// trip through the queue. A skip is passed on before the count drops,
+			// so whoever starts the successor sees it.
+			Node next = nodes.size();
+			for (Node successor : nodes[node].successors)
+			{
+				if (skip)
+					skipped[successor] = true;
+				if (pending[successor].fetch_sub(1) == 1)
+				{
+					if (next != nodes.size())
+						start(next);
+					next = successor;
+				}
+			}
+
+			if (remaining.fetch_sub(1) == 1)
+				finish();
+			if (next == nodes.size())
+				return;
+			node = next;
+		}
+	}
+
+	void fail(std::exception_ptr e)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error)
+			error = e;
+	}
+
+	void finish()
+	{
+		if (error)
+			done->set_exception(error);
+		else
+			done->set_value();
+	}
+
+	ThreadPool& pool;
+	const std::vector<NodeData> nodes;
+	std::unique_ptr<std::atomic<size_t>[]> pending;
+	std::unique_ptr<std::atomic<bool>[]> skipped;  // A predecessor failed or was skipped
+	std::atomic<size_t> remaining;
+	std::mutex mutex;
+	std::exception_ptr error;
+	std::shared_ptr<thread_pool_detail::FutureState<void>> done;
+};
+
+template<class F>
+TaskGraph::Node TaskGraph::add(F&& fn)
+{
+	NodeData node;
+	node.fn = std::forward<F>(fn);
+	node.predecessors = 0;
+	nodes_.push_back(std::move(node));
+	return nodes_.size() - 1;
+}
+
+template<class F>
+TaskGraph::Node TaskGraph::add(F&& fn, std::initializer_list<Node> after)
+{
+	Node node = add(std::forward<F>(fn));
+	for (Node before : after)
+		precede(before, node);
+	return node;
+}
+
+inline void TaskGraph::precede(Node before, Node after)
+{
+	if (before >= nodes_.size() || after >= nodes_.size() || before == after)
+		throw std::invalid_argument("TaskGraph::precede: invalid node");
+	nodes_[before].successors.push_back(after);
+	nodes_[after].predecessors++;
+}
+
+inline TaskFuture<void> TaskGraph::run(ThreadPool& pool) const
+{
+	// Kahn's algorithm: every node must be reachable from a root
+	std::vector<size_t> pending(nodes_.size());
+	std::vector<Node> ready;
+	for (Node i = 0; i < nodes_.size(); ++i)
+	{
+		pending[i] = nodes_[i].predecessors;
+		if (pending[i] == 0)
+			ready.push_back(i);
+	}
+	const std::vector<Node> roots = ready;
+	size_t visited = 0;
+	while (!ready.empty())
+	{
+		Node node = ready.back();
+		ready.pop_back();
+		visited++;
+		for (Node successor : nodes_[node].successors)
+			if (--pending[successor] == 0)
+				ready.push_back(successor);
+	}
+	if (visited != nodes_.size())
+		throw std::logic_error("TaskGraph::run: dependency cycle");
+
+	std::shared_ptr<Run> run = std::make_shared<Run>(pool, nodes_);
+	if (nodes_.empty())
+		run->finish();
+	for (Node root : roots)
+		run->start(root);
+	return thread_pool_detail::future_access::make(run->done);
+}
+
+#endif
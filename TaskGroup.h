@@ -0,0 +1,374 @@
+﻿#ifndef TASK_GROUP_H
+#define TASK_GROUP_H
+
+#include "ThreadPool.h"
+
+namespace thread_pool_detail
+{
+	// One task group: its queue and its share of the scheduler. All fields are
+	// guarded by the scheduler mutex.
+	struct GroupState
+	{
+		GroupState(unsigned weight, size_t max_concurrency)
+			: weight(weight > 0 ? weight : 1), max_concurrency(max_concurrency), running(0), vtime(0), average_ns(0)
+		{
+		}
+
+		unsigned weight;
+		size_t max_concurrency;  // 0: no cap
+		std::deque<Task> queue;
+		size_t running;  // Tasks executing right now
+		double vtime;  // Run time charged so far, in nanoseconds divided by weight
+		double average_ns;  // Moving average of the task run time
+		ThreadPool::CancellationSource cancel;
+		std::vector<std::promise<void>> drain_waiters;
+
+		size_t pending() const { return queue.size() + running; }
+
+		// Tasks a runner could start right now
+		size_t eligible() const
+		{
+			if (max_concurrency == 0)
+				return queue.size();
+			return running < max_concurrency ? std::min(queue.size(), max_concurrency - running) : 0;
+		}
+	};
+
+	// Weighted fair sharing of a pool between task groups. Runners are
+	// ordinary pool tasks, at most max_runners of them at a time, each running
+	// one group task after another. A runner always serves the eligible group
+	// (queued work, below its cap) that has been charged the least run time per
+	// unit of weight, so over time the groups get pool time in proportion to
+	// their weights. A task is charged its group's average run time when it
+	// starts and corrected when it ends, so runners picking at the same time
+	// see each other's choices. A group that was idle starts again at the
+	// lowest charge of the active groups: idling does not bank credit.
+	class GroupSchedulerState : public std::enable_shared_from_this<GroupSchedulerState>
+	{
+	public:
+		GroupSchedulerState(ThreadPool& pool, size_t max_runners, size_t max_batch)
+			: pool_(pool), max_runners_(max_runners > 0 ? max_runners : std::max<size_t>(1, pool.size())),
+			max_batch_(max_batch > 0 ? max_batch : 1), runners_(0), busy_(0), eligible_(0)
+		{
+		}
+
+		GroupSchedulerState(const GroupSchedulerState&) = delete;
+		GroupSchedulerState& operator=(const GroupSchedulerState&) = delete;
+
+		ThreadPool& pool() const { return pool_; }
+
+		void add(const std::shared_ptr<GroupState>& group)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			groups_.push_back(group);
+		}
+
+		// The group must have drained
+		void remove(const std::shared_ptr<GroupState>& group)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			groups_.erase(std::remove(groups_.begin(), groups_.end(), group), groups_.end());
+		}
+
+		void push(GroupState& group, Task&& task)
+		{
+			bool start_runner;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (group.pending() == 0)
+					group.vtime = std::max(group.vtime, lowest_vtime(group.vtime));
+				const size_t before = group.eligible();
+				group.queue.push_back(std::move(task));
+				eligible_ += group.eligible() - before;
+				start_runner = wanted_runner();
+				if (start_runner)
+					runners_++;
+			}
+			if (start_runner)
+				schedule();
+		}
+
+		void set_limits(GroupState& group, unsigned weight, size_t max_concurrency)
+		{
+			size_t started = 0;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				group.weight = weight > 0 ? weight : 1;
+				const size_t before = group.eligible();
+				group.max_concurrency = max_concurrency;
+				eligible_ = eligible_ - before + group.eligible();
+				for (; wanted_runner(); ++started)
+					runners_++;
+			}
+			for (size_t i = 0; i < started; ++i)
+				schedule();
+		}
+
+		// Drop the queued tasks (their futures get TaskCancelled) and cancel the
+		// token running tasks may watch; later tasks get a fresh token
+		void cancel(GroupState& group)
+		{
+			std::deque<Task> dropped;
+			ThreadPool::CancellationSource source;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				eligible_ -= group.eligible();
+				dropped.swap(group.queue);
+				std::swap(source, group.cancel);
+			}
+			source.cancel();
+			for (Task& task : dropped)
+				task.cancel(std::make_exception_ptr(ThreadPool::TaskCancelled(ThreadPool::TaskCancelled::Reason::CANCELLED)));
+			dropped.clear();
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			settle(group);
+		}
+
+		ThreadPool::CancellationToken token(const GroupState& group)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return group.cancel.token();
+		}
+
+		size_t pending(const GroupState& group)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return group.pending();
+		}
+
+		// Completes once the group has neither queued nor running tasks
+		std::future<void> drained(GroupState& group)
+		{
+			std::promise<void> done;
+			std::future<void> result = done.get_future();
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (group.pending() == 0)
+				done.set_value();
+			else
+				group.drain_waiters.push_back(std::move(done));
+			return result;
+		}
+
+	private:
+		struct Runner
+		{
+			std::shared_ptr<GroupSchedulerState> state;
+
+			void operator()() { state->run(); }
+		};
+
+		void schedule()
+		{
+			Runner runner = { shared_from_this() };
+			pool_access::post(pool_, std::move(runner));
+		}
+
+		// Runners that are not executing a task fall short of the eligible work
+		bool wanted_runner() const
+		{
+			return runners_ < max_runners_ && runners_ - busy_ < eligible_;
+		}
+
+		// Up to max_batch tasks, then back into the pool queue so other pool
+		// work gets its turn; leaves when no group is eligible
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			for (size_t done = 0;; ++done)
+			{
+				std::shared_ptr<GroupState> group = pick();
+				if (!group)
+				{
+					runners_--;
+					return;
+				}
+				if (done == max_batch_)
+				{
+					lock.unlock();
+					schedule();
+					return;
+				}
+
+				const size_t before = group->eligible();
+				Task task = std::move(group->queue.front());
+				group->queue.pop_front();
+				group->running++;
+				eligible_ = eligible_ - before + group->eligible();
+				const double charged = group->average_ns / group->weight;
+				group->vtime += charged;
+				busy_++;
+				lock.unlock();
+
+				const long long start = now_ns();
+				try
+				{
+					task();
+				}
+				catch (...)
+				{
+					pool_access::handle_exception(pool_, std::current_exception());
+				}
+				task.reset();
+				const double elapsed = static_cast<double>(now_ns() - start);
+
+				lock.lock();
+				busy_--;
+				const size_t previous = group->eligible();
+				group->running--;
+				group->vtime += elapsed / group->weight - charged;
+				group->average_ns = group->average_ns > 0 ? group->average_ns + (elapsed - group->average_ns) / 8 : elapsed;
+				eligible_ = eligible_ - previous + group->eligible();
+				settle(*group);
+			}
+		}
+
+		// Eligible group with the least charged time (requires mutex_)
+		std::shared_ptr<GroupState> pick() const
+		{
+			std::shared_ptr<GroupState> best;
+			for (const std::shared_ptr<GroupState>& group : groups_)
+				if (group->eligible() > 0 && (!best || group->vtime < best->vtime))
+					best = group;
+			return best;
+		}
+
+		// Lowest charge among the groups with work, fallback if there is none
+		double lowest_vtime(double fallback) const
+		{
+			bool found = false;
+			double lowest = fallback;
+			for (const std::shared_ptr<GroupState>& group : groups_)
+			{
+				if (group->pending() > 0 && (!found || group->vtime < lowest))
+				{
+					lowest = group->vtime;
+					found = true;
+				}
+			}
+			return lowest;
+		}
+
+		// Release drain() waiters once the group is empty (requires mutex_)
+		static void settle(GroupState& group)
+		{
+			if (group.pending() > 0)
+				return;
+			for (std::promise<void>& waiter : group.drain_waiters)
+				waiter.set_value();
+			group.drain_waiters.clear();
+		}
+
+		ThreadPool& pool_;
+		const size_t max_runners_;
+		const size_t max_batch_;
+		std::mutex mutex_;
+		std::vector<std::shared_ptr<GroupState>> groups_;
+		size_t runners_;  // Posted and not yet returned
+		size_t busy_;  // Runners executing a task
+		size_t eligible_;  // Sum of eligible() over the groups
+	};
+}
+
+// Shares one pool between task groups, e.g. one per tenant, instead of one
+// pool per tenant oversubscribing the cores. At most max_workers workers
+// (default: all of the pool) run group tasks at a time; how they are split
+// between the groups follows the group weights. A worker running group tasks
+// returns to the pool queue after max_batch of them. The scheduler must
+// outlive its groups.
+class GroupScheduler
+{
+public:
+	explicit GroupScheduler(ThreadPool& pool, size_t max_workers = 0, size_t max_batch = 16)
+		: state_(thread_pool_detail::make_shared_state<thread_pool_detail::GroupSchedulerState>(
+			pool, max_workers, max_batch))
+	{
+	}
+
+	GroupScheduler(const GroupScheduler&) = delete;
+	GroupScheduler& operator=(const GroupScheduler&) = delete;
+
+	ThreadPool& pool() const { return state_->pool(); }
+
+private:
+	friend class TaskGroup;
+
+	std::shared_ptr<thread_pool_detail::GroupSchedulerState> state_;
+};
+
+// Tasks of one tenant on a GroupScheduler. With work queued in several
+// groups, each gets pool time in proportion to its weight; max_concurrency
+// caps how many of its tasks run at once (0: no cap), so a burst in one group
+// cannot take every worker. Tasks are started in FIFO order within a group.
+// The destructor waits for the group's tasks.
+class TaskGroup
+{
+public:
+	explicit TaskGroup(GroupScheduler& scheduler, unsigned weight = 1, size_t max_concurrency = 0)
+		: scheduler_(scheduler.state_),
+		state_(thread_pool_detail::make_shared_state<thread_pool_detail::GroupState>(weight, max_concurrency))
+	{
+		scheduler_->add(state_);
+	}
+
+	~TaskGroup()
+	{
+		drain();
+		scheduler_->remove(state_);
+	}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	ThreadPool& pool() const { return scheduler_->pool(); }
+
+	// Fire-and-forget: exceptions go to the pool's exception handler
+	template<class F, class... Args>
+	void post(F&& f, Args&&... args)
+	{
+		scheduler_->push(*state_, thread_pool_detail::Task(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+	}
+
+	template<class F, class... Args>
+	auto enqueue(F&& f, Args&&... args)
+		-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>
+	{
+		using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+		typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+		thread_pool_detail::PromiseTask<return_type, bound_type> task(
+			std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+		std::future<return_type> result = task.promise.get_future();
+		scheduler_->push(*state_, thread_pool_detail::Task(std::move(task)));
+		return result;
+	}
+
+	// Wait until none of the group's tasks is queued or running, running other
+	// pool tasks meanwhile when called on a worker. Not from one of the group's
+	// own tasks, which would wait for itself.
+	void drain()
+	{
+		std::future<void> done = scheduler_->drained(*state_);
+		pool().wait(done);
+		done.get();
+	}
+
+	// Drop the queued tasks; their futures get ThreadPool::TaskCancelled.
+	// Running tasks finish, but the token they got from token() is cancelled.
+	void cancel() { scheduler_->cancel(*state_); }
+
+	// Token of the group's current tasks, for long ones to poll
+	ThreadPool::CancellationToken token() const { return scheduler_->token(*state_); }
+
+	// Queued plus running tasks
+	size_t pending() const { return scheduler_->pending(*state_); }
+
+	// Change the share and the cap; takes effect from the next task started
+	void set_limits(unsigned weight, size_t max_concurrency) { scheduler_->set_limits(*state_, weight, max_concurrency); }
+
+private:
+	std::shared_ptr<thread_pool_detail::GroupSchedulerState> scheduler_;
+	std::shared_ptr<thread_pool_detail::GroupState> state_;
+};
+
+#endif
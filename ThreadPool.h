@@ -2,15 +2,38 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
+#include <deque>
+#include <atomic>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <future>
 #include <functional>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <cstddef>
 #include <stdexcept>
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <chrono>
+#include <string>
+#include <system_error>
+#include <climits>
+
+// Define THREAD_POOL_METRICS before including this header to collect per-worker
+// counters and latency histograms for ThreadPool::stats(). Without it the
+// instrumentation compiles away and stats() only reports queue state.
+
+// C++20 coroutine support: ThreadPool::schedule() and Coroutine.h
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define THREAD_POOL_COROUTINES 1
+#endif
+#endif
 
 // Platform-specific CPU affinity and priority settings
 #if defined(_WIN32)
@@ -18,168 +41,4038 @@
 #elif defined(__linux__)
 #include <sched.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <fstream>
+#include <cstdlib>
+#endif
+
+namespace thread_pool_detail
+{
+	// Monotonic clock in nanoseconds
+	inline long long now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Allocation hook for task storage and shared result states. Blocks must be
+	// aligned to allocation_align; deallocate may run on any thread.
+	struct AllocatorHooks
+	{
+		void* (*allocate)(size_t bytes);
+		void (*deallocate)(void* p, size_t bytes);
+	};
+
+	static const size_t allocation_align = 16;
+
+	// Thread-local slab arena: size classes from 64 to 1024 bytes carved out of
+	// 64 KiB slabs, so a task allocation is a free-list pop on the calling
+	// thread. Blocks freed on another thread are batched per owner and handed
+	// back with one CAS; the owner reclaims them when its own lists run dry.
+	// Arenas of exited threads are adopted by new threads, never released.
+	class SlabArena
+	{
+	public:
+		static const size_t class_count = 5;
+		static const size_t min_block = 64;
+		static const size_t slab_size = 64 * 1024;
+		static const size_t batch_size = 32;
+
+		static void* allocate(size_t bytes)
+		{
+			const size_t size_class = class_of(bytes + sizeof(Block));
+			SlabArena* arena = size_class < class_count ? local() : nullptr;
+			Block* block = arena ? arena->take(size_class)
+				: static_cast<Block*>(::operator new(bytes + sizeof(Block)));
+			block->owner = arena;
+			block->size_class = size_class;
+			return block + 1;
+		}
+
+		static void deallocate(void* p, size_t)
+		{
+			if (!p)
+				return;
+			Block* block = static_cast<Block*>(p) - 1;
+			SlabArena* owner = block->owner;
+			if (!owner)
+			{
+				::operator delete(block);
+				return;
+			}
+			LocalState& state = local_state();
+			if (owner == state.arena)
+			{
+				block->next = owner->free_[block->size_class];
+				owner->free_[block->size_class] = block;
+				return;
+			}
+
+			// Foreign block: batch it up for its owner
+			block->next = nullptr;
+			if (state.exited)
+			{
+				push_remote(owner, block, block);
+				return;
+			}
+			RemoteBatch& batch = state.batch;
+			if (batch.owner != owner)
+			{
+				flush(batch);
+				batch.owner = owner;
+			}
+			if (batch.tail)
+				batch.tail->next = block;
+			else
+				batch.head = block;
+			batch.tail = block;
+			if (++batch.count >= batch_size)
+				flush(batch);
+		}
+
+		// Create the calling thread's arena and fault in its current slab, so the
+		// first task allocations on this thread neither lock nor page-fault
+		static void prime()
+		{
+			SlabArena* arena = local();
+			if (!arena)
+				return;
+			Block* block = arena->take(0);
+			block->next = arena->free_[0];
+			arena->free_[0] = block;
+			for (volatile char* page = arena->cursor_; page < arena->end_; page += 4096)
+				*page = 0;
+		}
+
+	private:
+		// Block header, allocation_align bytes: the owner while allocated, the
+		// free list link while free. The size class stays valid in both states.
+		struct alignas(allocation_align) Block
+		{
+			union
+			{
+				SlabArena* owner;
+				Block* next;
+			};
+			size_t size_class;
+		};
+
+		struct RemoteBatch
+		{
+			SlabArena* owner;
+			Block* head;
+			Block* tail;
+			size_t count;
+		};
+
+		// Per-thread state; the destructor runs at thread exit
+		struct LocalState
+		{
+			SlabArena* arena = nullptr;
+			RemoteBatch batch = { nullptr, nullptr, nullptr, 0 };
+			bool exited = false;
+
+			~LocalState()
+			{
+				flush(batch);
+				exited = true;
+				if (arena)
+				{
+					std::lock_guard<std::mutex> lock(orphan_mutex());
+					orphans().push_back(arena);
+					arena = nullptr;
+				}
+			}
+		};
+
+		SlabArena() : remote_(nullptr), cursor_(nullptr), end_(nullptr)
+		{
+			for (size_t i = 0; i < class_count; ++i)
+				free_[i] = nullptr;
+		}
+
+		static size_t class_of(size_t bytes)
+		{
+			size_t size_class = 0;
+			for (size_t block = min_block; block < bytes && size_class < class_count; block <<= 1)
+				++size_class;
+			return size_class;
+		}
+
+		static LocalState& local_state()
+		{
+			static thread_local LocalState state;
+			return state;
+		}
+
+		static std::mutex& orphan_mutex()
+		{
+			static std::mutex* mutex = new std::mutex;  // Outlives static destructors
+			return *mutex;
+		}
+
+		static std::vector<SlabArena*>& orphans()
+		{
+			static std::vector<SlabArena*>* arenas = new std::vector<SlabArena*>;
+			return *arenas;
+		}
+
+		// Arena of the calling thread (nullptr during thread exit)
+		static SlabArena* local()
+		{
+			LocalState& state = local_state();
+			if (!state.arena && !state.exited)
+			{
+				std::lock_guard<std::mutex> lock(orphan_mutex());
+				if (orphans().empty())
+				{
+					state.arena = new SlabArena;
+				}
+				else
+				{
+					state.arena = orphans().back();
+					orphans().pop_back();
+				}
+			}
+			return state.arena;
+		}
+
+		static void flush(RemoteBatch& batch)
+		{
+			if (batch.head)
+				push_remote(batch.owner, batch.head, batch.tail);
+			batch.owner = nullptr;
+			batch.head = batch.tail = nullptr;
+			batch.count = 0;
+		}
+
+		static void push_remote(SlabArena* owner, Block* head, Block* tail)
+		{
+			Block* top = owner->remote_.load(std::memory_order_relaxed);
+			do
+			{
+				tail->next = top;
+			} while (!owner->remote_.compare_exchange_weak(top, head,
+				std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		Block* take(size_t size_class)
+		{
+			if (!free_[size_class])
+				reclaim();
+			Block* block = free_[size_class];
+			if (block)
+			{
+				free_[size_class] = block->next;
+				return block;
+			}
+			return carve(min_block << size_class);
+		}
+
+		// Move all remotely freed blocks to the local free lists
+		void reclaim()
+		{
+			Block* block = remote_.exchange(nullptr, std::memory_order_acquire);
+			while (block)
+			{
+				Block* next = block->next;
+				block->next = free_[block->size_class];
+				free_[block->size_class] = block;
+				block = next;
+			}
+		}
+
+		Block* carve(size_t bytes)
+		{
+			if (static_cast<size_t>(end_ - cursor_) < bytes)
+			{
+				cursor_ = static_cast<char*>(::operator new(slab_size));
+				end_ = cursor_ + slab_size;
+			}
+			Block* block = reinterpret_cast<Block*>(cursor_);
+			cursor_ += bytes;
+			return block;
+		}
+
+		Block* free_[class_count];
+		std::atomic<Block*> remote_;
+		char* cursor_;
+		char* end_;
+	};
+
+	inline const AllocatorHooks* arena_hooks()
+	{
+		static const AllocatorHooks arena = { &SlabArena::allocate, &SlabArena::deallocate };
+		return &arena;
+	}
+
+	inline std::atomic<const AllocatorHooks*>& allocator_hooks()
+	{
+		static std::atomic<const AllocatorHooks*> hooks(arena_hooks());
+		return hooks;
+	}
+
+	// Every block starts with the hooks that allocated it, so one allocated
+	// before set_allocator() is still freed by its own allocator
+	struct BlockHeader
+	{
+		const AllocatorHooks* hooks;
+	};
+	static const size_t block_header_size = allocation_align;
+	static_assert(sizeof(BlockHeader) <= block_header_size, "block header too large");
+
+	inline void* allocate_block(size_t bytes)
+	{
+		const AllocatorHooks* hooks = allocator_hooks().load(std::memory_order_acquire);
+		char* memory = static_cast<char*>(hooks->allocate(bytes + block_header_size));
+		::new (memory) BlockHeader{ hooks };
+		return memory + block_header_size;
+	}
+
+	inline void deallocate_block(void* p, size_t bytes)
+	{
+		if (!p)
+			return;
+		char* memory = static_cast<char*>(p) - block_header_size;
+		const AllocatorHooks* hooks = reinterpret_cast<BlockHeader*>(memory)->hooks;
+		hooks->deallocate(memory, bytes + block_header_size);
+	}
+
+	// Standard allocator over the hooks, for promise and shared_ptr states
+	template<class T>
+	struct PoolAllocator
+	{
+		typedef T value_type;
+
+		PoolAllocator() noexcept {}
+		template<class U>
+		PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+		T* allocate(size_t n)
+		{
+			static_assert(alignof(T) <= allocation_align, "over-aligned type");
+			return static_cast<T*>(allocate_block(n * sizeof(T)));
+		}
+
+		void deallocate(T* p, size_t n) noexcept { deallocate_block(p, n * sizeof(T)); }
+
+		template<class U>
+		struct rebind
+		{
+			typedef PoolAllocator<U> other;
+		};
+	};
+
+	template<class T, class U>
+	bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept { return true; }
+
+	template<class T, class U>
+	bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept { return false; }
+
+	// Shared state from the allocator hooks, std::make_shared if over-aligned
+	template<class T, class... Args>
+	std::shared_ptr<T> allocate_state(std::true_type, Args&&... args)
+	{
+		return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+	}
+
+	template<class T, class... Args>
+	std::shared_ptr<T> allocate_state(std::false_type, Args&&... args)
+	{
+		return std::make_shared<T>(std::forward<Args>(args)...);
+	}
+
+	template<class T, class... Args>
+	std::shared_ptr<T> make_shared_state(Args&&... args)
+	{
+		return allocate_state<T>(std::integral_constant<bool, alignof(T) <= allocation_align>(),
+			std::forward<Args>(args)...);
+	}
+
+	// Shared flag behind CancellationSource/CancellationToken
+	struct CancelState
+	{
+		std::atomic<bool> cancelled{ false };
+	};
+
+	// Per-task options checked when a task is dequeued
+	struct TaskGuard
+	{
+		const char* tag;                      // TaskOptions::tag
+		std::shared_ptr<CancelState> cancel;  // TaskOptions::cancel, may be null
+		long long deadline_ns;                // now_ns() time, 0: none
+		unsigned long long epoch;             // Tag cancellation epoch at submission
+		bool droppable;                       // May be shed by OverflowPolicy::DROP_OLDEST
+	};
+
+	// Callable carrying TaskOptions that need a check at dequeue time, or a tag
+	// for tracing
+	template<class Fn>
+	struct GuardedTask
+	{
+		TaskGuard guard;
+		Fn fn;
+
+		void operator()() { fn(); }
+	};
+
+	template<class Fn>
+	struct task_guard
+	{
+		static const TaskGuard* get(const Fn&) { return nullptr; }
+	};
+
+	template<class Fn>
+	struct task_guard<GuardedTask<Fn>>
+	{
+		static const TaskGuard* get(const GuardedTask<Fn>& task) { return &task.guard; }
+	};
+
+	// Complete a task that is dropped without running: callables owning a
+	// result (PromiseTask) store error in it, others are just destroyed
+	template<class Fn>
+	void cancel_task(Fn&, std::exception_ptr) {}
+
+	template<class Fn>
+	void cancel_task(GuardedTask<Fn>& task, std::exception_ptr error) { cancel_task(task.fn, error); }
+
+	// Move-only type-erased callable with inline storage for small captures.
+	// Callables that do not fit (or may throw on move) fall back to one heap block.
+	class Task
+	{
+	public:
+		// 56 bytes of storage plus the ops pointer keep a Task within one cache line
+		static const size_t inline_size = 56;
+		static const size_t inline_align = alignof(double) > alignof(void*) ? alignof(double) : alignof(void*);
+
+		Task() noexcept : ops_(nullptr) {}
+
+		template<class F, class Fn = typename std::decay<F>::type,
+			class = typename std::enable_if<!std::is_same<Fn, Task>::value>::type>
+		Task(F&& f) : ops_(&ops_for<Fn>::table)
+		{
+			ops_for<Fn>::construct(&storage_, std::forward<F>(f),
+				std::integral_constant<bool, ops_for<Fn>::is_inline>());
+#if defined(THREAD_POOL_METRICS)
+			created_ = now_ns();
+#endif
+		}
+
+		Task(Task&& other) noexcept : ops_(other.ops_)
+		{
+			if (ops_)
+				ops_->move(&storage_, &other.storage_);
+			other.ops_ = nullptr;
+#if defined(THREAD_POOL_METRICS)
+			created_ = other.created_;
+#endif
+		}
+
+		Task& operator=(Task&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				ops_ = other.ops_;
+				if (ops_)
+					ops_->move(&storage_, &other.storage_);
+				other.ops_ = nullptr;
+#if defined(THREAD_POOL_METRICS)
+				created_ = other.created_;
+#endif
+			}
+			return *this;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		~Task() { reset(); }
+
+		explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+		void operator()() { ops_->invoke(&storage_); }
+
+		// Options of a GuardedTask, nullptr otherwise
+		const TaskGuard* guard() const noexcept { return ops_ ? ops_->guard(&storage_) : nullptr; }
+
+		// TaskOptions::tag, nullptr if untagged
+		const char* tag() const noexcept
+		{
+			const TaskGuard* options = guard();
+			return options ? options->tag : nullptr;
+		}
+
+		// Drop the task: a result it owns is completed with error
+		void cancel(std::exception_ptr error)
+		{
+			if (ops_)
+			{
+				ops_->cancel(&storage_, error);
+				reset();
+			}
+		}
+
+		void reset() noexcept
+		{
+			if (ops_)
+			{
+				ops_->destroy(&storage_);
+				ops_ = nullptr;
+			}
+		}
+
+#if defined(THREAD_POOL_METRICS)
+		// Submission time (now_ns()), for the queue wait histogram. Costs 8 bytes
+		// beyond the cache line.
+		long long created_at() const noexcept { return created_; }
+#endif
+
+	private:
+		typedef typename std::aligned_storage<inline_size, inline_align>::type Storage;
+
+		struct Ops
+		{
+			void (*invoke)(void* storage);
+			void (*move)(void* dst, void* src) noexcept;
+			void (*destroy)(void* storage) noexcept;
+			const TaskGuard* (*guard)(const void* storage) noexcept;
+			void (*cancel)(void* storage, std::exception_ptr error);
+		};
+
+		template<class Fn>
+		struct ops_for
+		{
+			static const bool is_inline = sizeof(Fn) <= inline_size
+				&& inline_align % alignof(Fn) == 0
+				&& std::is_nothrow_move_constructible<Fn>::value;
+
+			template<class F>
+			static void construct(void* storage, F&& f, std::true_type)
+			{
+				::new (storage) Fn(std::forward<F>(f));
+			}
+			template<class F>
+			static void construct(void* storage, F&& f, std::false_type)
+			{
+				*static_cast<Fn**>(storage) = create(std::forward<F>(f),
+					std::integral_constant<bool, alignof(Fn) <= allocation_align>());
+			}
+
+			// Heap storage through the allocator hooks, plain new if over-aligned
+			template<class F>
+			static Fn* create(F&& f, std::true_type)
+			{
+				void* memory = allocate_block(sizeof(Fn));
+				try
+				{
+					return ::new (memory) Fn(std::forward<F>(f));
+				}
+				catch (...)
+				{
+					deallocate_block(memory, sizeof(Fn));
+					throw;
+				}
+			}
+			template<class F>
+			static Fn* create(F&& f, std::false_type) { return new Fn(std::forward<F>(f)); }
+
+			static void dispose(Fn* fn, std::true_type) noexcept
+			{
+				fn->~Fn();
+				deallocate_block(fn, sizeof(Fn));
+			}
+			static void dispose(Fn* fn, std::false_type) noexcept { delete fn; }
+
+			static Fn& get(void* storage, std::true_type) { return *static_cast<Fn*>(storage); }
+			static Fn& get(void* storage, std::false_type) { return **static_cast<Fn**>(storage); }
+			static Fn& get(void* storage) { return get(storage, std::integral_constant<bool, is_inline>()); }
+
+			static void invoke(void* storage) { get(storage)(); }
+
+			static const TaskGuard* guard(const void* storage) noexcept
+			{
+				return task_guard<Fn>::get(get(const_cast<void*>(storage)));
+			}
+
+			static void cancel(void* storage, std::exception_ptr error) { cancel_task(get(storage), error); }
+
+			static void move(void* dst, void* src, std::true_type) noexcept
+			{
+				Fn& from = *static_cast<Fn*>(src);
+				::new (dst) Fn(std::move(from));
+				from.~Fn();
+			}
+			static void move(void* dst, void* src, std::false_type) noexcept
+			{
+				*static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+			}
+			static void move(void* dst, void* src) noexcept
+			{
+				move(dst, src, std::integral_constant<bool, is_inline>());
+			}
+
+			static void destroy(void* storage, std::true_type) noexcept { static_cast<Fn*>(storage)->~Fn(); }
+			static void destroy(void* storage, std::false_type) noexcept
+			{
+				dispose(*static_cast<Fn**>(storage), std::integral_constant<bool, alignof(Fn) <= allocation_align>());
+			}
+			static void destroy(void* storage) noexcept
+			{
+				destroy(storage, std::integral_constant<bool, is_inline>());
+			}
+
+			static const Ops table;
+		};
+
+		Storage storage_;
+		const Ops* ops_;
+#if defined(THREAD_POOL_METRICS)
+		long long created_ = 0;
+#endif
+	};
+
+	template<class Fn>
+	const Task::Ops Task::ops_for<Fn>::table = { &invoke, &move, &destroy, &guard, &cancel };
+
+	// Run fn and publish its result (or exception) into promise
+	template<class R, class Fn>
+	void fulfill(std::promise<R>& promise, Fn& fn)
+	{
+		try
+		{
+			promise.set_value(fn());
+		}
+		catch (...)
+		{
+			promise.set_exception(std::current_exception());
+		}
+	}
+
+	template<class Fn>
+	void fulfill(std::promise<void>& promise, Fn& fn)
+	{
+		try
+		{
+			fn();
+			promise.set_value();
+		}
+		catch (...)
+		{
+			promise.set_exception(std::current_exception());
+		}
+	}
+
+	// Allocator for a promise's shared state (rebound by std::promise): the
+	// hooks unless R is over-aligned
+	template<class R>
+	struct promise_allocator
+	{
+		typedef typename std::conditional<std::is_void<R>::value || std::is_reference<R>::value,
+			void*, R>::type stored_type;
+		typedef typename std::conditional<alignof(stored_type) <= allocation_align,
+			PoolAllocator<char>, std::allocator<char>>::type type;
+	};
+
+	// Callable owning both the promise and the bound function: the future's
+	// shared state is the only allocation made per enqueue, and it comes from
+	// the allocator hooks
+	template<class R, class Fn>
+	struct PromiseTask
+	{
+		std::promise<R> promise;
+		Fn fn;
+
+		template<class G>
+		explicit PromiseTask(G&& g)
+			: promise(std::allocator_arg, typename promise_allocator<R>::type()), fn(std::forward<G>(g)) {}
+
+		void operator()() { fulfill(promise, fn); }
+	};
+
+	template<class R, class Fn>
+	void cancel_task(PromiseTask<R, Fn>& task, std::exception_ptr error) { task.promise.set_exception(error); }
+
+	// Shared completion state of enqueue_bulk(count, f): a single promise that is
+	// fulfilled by whichever task finishes last
+	template<class Fn>
+	struct BulkState
+	{
+		Fn fn;
+		std::atomic<size_t> remaining;
+		std::promise<void> promise;
+		std::mutex error_mutex;
+		std::exception_ptr error;
+
+		template<class G>
+		BulkState(G&& g, size_t count) : fn(std::forward<G>(g)), remaining(count) {}
+
+		void run(size_t index)
+		{
+			try
+			{
+				fn(index);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+			if (remaining.fetch_sub(1) == 1)
+			{
+				if (error)
+					promise.set_exception(error);
+				else
+					promise.set_value();
+			}
+		}
+	};
+
+	template<class Fn>
+	struct BulkTask
+	{
+		std::shared_ptr<BulkState<Fn>> state;
+		size_t index;
+
+		void operator()() { state->run(index); }
+	};
+
+	// Size assumed for padding hot atomics onto separate cache lines
+	static const size_t cache_line_size = 64;
+
+	// Spin-wait hint for the current core
+	inline void cpu_relax()
+	{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield");
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	// Bounded lock-free multi-producer/multi-consumer ring buffer (D. Vyukov's
+	// design): every slot carries a sequence number telling producers and
+	// consumers whose turn it is, head and tail live on separate cache lines
+	template<class T>
+	class MpmcQueue
+	{
+	public:
+		explicit MpmcQueue(size_t capacity)
+			: mask_(round_up(capacity) - 1), cells_(new Cell[mask_ + 1]),
+			enqueue_pos_(0), dequeue_pos_(0)
+		{
+			for (size_t i = 0; i <= mask_; ++i)
+				cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		~MpmcQueue()
+		{
+			T value;
+			while (try_pop(value))
+			{
+			}
+		}
+
+		MpmcQueue(const MpmcQueue&) = delete;
+		MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+		size_t capacity() const { return mask_ + 1; }
+
+		bool try_push(T&& value)
+		{
+			size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				Cell& cell = cells_[pos & mask_];
+				size_t sequence = cell.sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+				if (diff == 0)
+				{
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						::new (static_cast<void*>(&cell.storage)) T(std::move(value));
+						cell.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;  // Full
+				}
+				else
+				{
+					pos = enqueue_pos_.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		bool try_pop(T& value)
+		{
+			size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				Cell& cell = cells_[pos & mask_];
+				size_t sequence = cell.sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+				if (diff == 0)
+				{
+					if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						T* item = reinterpret_cast<T*>(&cell.storage);
+						value = std::move(*item);
+						item->~T();
+						cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;  // Empty
+				}
+				else
+				{
+					pos = dequeue_pos_.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Items currently queued (approximate while producers or consumers run)
+		size_t size_approx() const
+		{
+			size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+			size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+			return enqueued > dequeued ? enqueued - dequeued : 0;
+		}
+
+		// True if a consumer would currently find an item
+		bool has_items() const
+		{
+			size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+			const Cell& cell = cells_[pos & mask_];
+			return static_cast<std::ptrdiff_t>(cell.sequence.load(std::memory_order_acquire) - (pos + 1)) >= 0;
+		}
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+		};
+
+		static size_t round_up(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size <<= 1;
+			return size;
+		}
+
+		const size_t mask_;
+		const std::unique_ptr<Cell[]> cells_;
+		char pad0_[cache_line_size];
+		std::atomic<size_t> enqueue_pos_;
+		char pad1_[cache_line_size - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> dequeue_pos_;
+		char pad2_[cache_line_size - sizeof(std::atomic<size_t>)];
+	};
+
+	// Multi-level FIFO queue served highest level first. Anti-starvation aging:
+	// a non-empty level that has been passed over aging_limit times is served
+	// next, so lower levels keep a guaranteed share of the pops.
+	template<class T>
+	class PriorityQueue
+	{
+	public:
+		static const size_t levels = 4;
+
+		explicit PriorityQueue(size_t aging_limit = 0) : aging_limit_(aging_limit), size_(0)
+		{
+			for (size_t level = 0; level < levels; ++level)
+				skipped_[level] = 0;
+		}
+
+		void set_aging_limit(size_t aging_limit) { aging_limit_ = aging_limit; }
+
+		bool empty() const { return size_ == 0; }
+		size_t size() const { return size_; }
+
+		// Items on levels >= level
+		size_t size_from(size_t level) const
+		{
+			size_t count = 0;
+			for (; level < levels; ++level)
+				count += queues_[level].size();
+			return count;
+		}
+
+		void push(T&& value, size_t level)
+		{
+			queues_[level].push_back(std::move(value));
+			size_++;
+		}
+
+		// Pop the next item from levels >= min_level
+		bool try_pop(T& value, size_t min_level = 0)
+		{
+			size_t level = levels;
+			while (level > min_level && queues_[level - 1].empty())
+				--level;
+			if (level == min_level)
+				return false;
+			size_t serve = level - 1;
+
+			if (aging_limit_ > 0)
+			{
+				// Lowest starved level wins, every other waiting level ages by one pop
+				for (size_t lower = min_level; lower < serve; ++lower)
+				{
+					if (!queues_[lower].empty() && skipped_[lower] >= aging_limit_)
+					{
+						serve = lower;
+						break;
+					}
+				}
+				for (size_t other = min_level; other < levels; ++other)
+				{
+					if (other == serve)
+						skipped_[other] = 0;
+					else if (!queues_[other].empty())
+						skipped_[other]++;
+				}
+			}
+
+			value = std::move(queues_[serve].front());
+			queues_[serve].pop_front();
+			size_--;
+			return true;
+		}
+
+		// Remove the oldest item matching pred, lowest level first
+		template<class Pred>
+		bool remove_first(T& value, Pred pred)
+		{
+			for (size_t level = 0; level < levels; ++level)
+			{
+				for (typename std::deque<T>::iterator it = queues_[level].begin(); it != queues_[level].end(); ++it)
+				{
+					if (pred(*it))
+					{
+						value = std::move(*it);
+						queues_[level].erase(it);
+						size_--;
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+	private:
+		std::deque<T> queues_[levels];
+		size_t skipped_[levels];
+		size_t aging_limit_;
+		size_t size_;
+	};
+
+	// Log-linear latency histogram in the style of HdrHistogram: 16 linear
+	// sub-buckets per power of two, so values are resolved within 1/16. One
+	// writing thread (the owning worker), readable from any thread.
+	class LatencyHistogram
+	{
+	public:
+		static const unsigned sub_bits = 4;
+		static const unsigned sub_count = 1u << sub_bits;
+		static const unsigned bucket_count = (64 - sub_bits + 1) * sub_count;
+
+		LatencyHistogram()
+		{
+			for (unsigned i = 0; i < bucket_count; ++i)
+				counts_[i].store(0, std::memory_order_relaxed);
+		}
+
+		void record(unsigned long long value)
+		{
+			std::atomic<unsigned long long>& count = counts_[bucket(value)];
+			count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			total_.store(total_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			if (value > max_.load(std::memory_order_relaxed))
+				max_.store(value, std::memory_order_relaxed);
+		}
+
+		// Add the counts to a bucket array of bucket_count entries
+		void collect(std::vector<unsigned long long>& counts, unsigned long long& total,
+			unsigned long long& max) const
+		{
+			for (unsigned i = 0; i < bucket_count; ++i)
+				counts[i] += counts_[i].load(std::memory_order_relaxed);
+			total += total_.load(std::memory_order_relaxed);
+			max = std::max(max, max_.load(std::memory_order_relaxed));
+		}
+
+		static unsigned bucket(unsigned long long value)
+		{
+			if (value < sub_count)
+				return static_cast<unsigned>(value);
+			const unsigned msb = highest_bit(value);
+			return (msb - sub_bits + 1) * sub_count
+				+ static_cast<unsigned>((value >> (msb - sub_bits)) - sub_count);
+		}
+
+		// Midpoint of the values a bucket stands for
+		static unsigned long long bucket_value(unsigned index)
+		{
+			if (index < sub_count)
+				return index;
+			const unsigned shift = index / sub_count - 1;
+			const unsigned long long low = static_cast<unsigned long long>(sub_count + index % sub_count) << shift;
+			return low + ((1ull << shift) >> 1);
+		}
+
+	private:
+		static unsigned highest_bit(unsigned long long value)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+			unsigned bit = 0;
+			while (value >>= 1)
+				++bit;
+			return bit;
+#endif
+		}
+
+		std::atomic<unsigned long long> counts_[bucket_count];
+		std::atomic<unsigned long long> total_{ 0 };
+		std::atomic<unsigned long long> max_{ 0 };
+	};
+
+	// Per-worker instrumentation (THREAD_POOL_METRICS), written by its worker only
+	struct WorkerMetrics
+	{
+		LatencyHistogram queue_wait;
+		LatencyHistogram run_time;
+		std::atomic<unsigned long long> tasks{ 0 };
+		std::atomic<unsigned long long> steals{ 0 };
+		std::atomic<unsigned long long> busy_ns{ 0 };
+		std::atomic<long long> started_ns{ 0 };
+
+		static void add(std::atomic<unsigned long long>& counter, unsigned long long value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+	};
+
+	// std::result_of for C++11/14, std::invoke_result from C++17 on (result_of
+	// is removed in C++20)
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+	template<class F, class... Args>
+	struct invoke_result : std::invoke_result<F, Args...> {};
+#else
+	template<class F, class... Args>
+	struct invoke_result : std::result_of<F(Args...)> {};
+#endif
+
+	template<class T>
+	struct is_task_option : std::false_type {};
+
+	// Return type of enqueue-style members; SFINAE keeps option arguments
+	// (e.g. ThreadPool::TaskPriority) from being taken as the callable
+	template<bool IsOption, class F, class... Args>
+	struct task_future_impl {};
+
+	template<class F, class... Args>
+	struct task_future_impl<false, F, Args...>
+	{
+		typedef std::future<typename invoke_result<F, Args...>::type> type;
+	};
+
+	template<class F, class... Args>
+	struct task_future
+		: task_future_impl<is_task_option<typename std::decay<F>::type>::value, F, Args...> {};
+
+	template<class F>
+	struct enable_if_callable
+		: std::enable_if<!is_task_option<typename std::decay<F>::type>::value> {};
+
+#if defined(_WIN32)
+	// Call fn for every GetLogicalProcessorInformationEx record of a relationship
+	template<class Fn>
+	void for_each_processor_info(LOGICAL_PROCESSOR_RELATIONSHIP relation, Fn fn)
+	{
+		DWORD length = 0;
+		GetLogicalProcessorInformationEx(relation, nullptr, &length);
+		std::vector<char> buffer(length);
+		if (length == 0 || !GetLogicalProcessorInformationEx(relation,
+			reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &length))
+			return;
+		for (DWORD offset = 0; offset < length;)
+		{
+			const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& info =
+				*reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+			fn(info);
+			offset += info.Size;
+		}
+	}
+
+	// Append the processors of a group mask as group * 64 + processor number
+	inline void append_group_mask(std::vector<int>& cpus, const GROUP_AFFINITY& group)
+	{
+		for (int bit = 0; bit < 64; ++bit)
+			if ((static_cast<unsigned long long>(group.Mask) >> bit) & 1)
+				cpus.push_back(group.Group * 64 + bit);
+	}
+#elif defined(__linux__)
+	// Parse a Linux cpulist such as "0-3,8-11"
+	inline std::vector<int> parse_cpu_list(const std::string& text)
+	{
+		std::vector<int> cpus;
+		size_t pos = 0;
+		while (pos < text.size())
+		{
+			size_t end = text.find(',', pos);
+			if (end == std::string::npos)
+				end = text.size();
+			std::string item = text.substr(pos, end - pos);
+			size_t dash = item.find('-');
+			if (!item.empty() && item[0] >= '0' && item[0] <= '9')
+			{
+				int first = std::atoi(item.c_str());
+				int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+				for (int cpu = first; cpu <= last; ++cpu)
+					cpus.push_back(cpu);
+			}
+			pos = end + 1;
+		}
+		return cpus;
+	}
+
+	// First line of a sysfs file, empty if it does not exist
+	inline std::string read_sysfs(const std::string& path)
+	{
+		std::ifstream file(path);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	// Numbers N of the directory entries named <prefix>N
+	inline std::vector<int> sysfs_indices(const std::string& path, const std::string& prefix)
+	{
+		std::vector<int> indices;
+		if (DIR* dir = opendir(path.c_str()))
+		{
+			while (dirent* entry = readdir(dir))
+			{
+				std::string name = entry->d_name;
+				if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+					&& name[prefix.size()] >= '0' && name[prefix.size()] <= '9')
+					indices.push_back(std::atoi(name.c_str() + prefix.size()));
+			}
+			closedir(dir);
+		}
+		std::sort(indices.begin(), indices.end());
+		return indices;
+	}
+#endif
+
+	// Sort CPU groups by their first CPU and drop empty and duplicate groups
+	inline std::vector<std::vector<int>> unique_cpu_groups(std::vector<std::vector<int>> groups)
+	{
+		for (std::vector<int>& cpus : groups)
+			std::sort(cpus.begin(), cpus.end());
+		groups.erase(std::remove_if(groups.begin(), groups.end(),
+			[](const std::vector<int>& cpus) { return cpus.empty(); }), groups.end());
+		std::sort(groups.begin(), groups.end());
+		groups.erase(std::unique(groups.begin(), groups.end()), groups.end());
+		return groups;
+	}
+
+	inline std::vector<int> all_cpus()
+	{
+		std::vector<int> cpus;
+		unsigned count = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned cpu = 0; cpu < count; ++cpu)
+			cpus.push_back(static_cast<int>(cpu));
+		return cpus;
+	}
+
+	// CPUs are numbered like the cpu_affinity argument throughout: Linux CPU ids,
+	// on Windows group * 64 + processor number.
+
+	// NUMA topology: logical CPUs of every node, indexed by node number. Falls
+	// back to one node holding all CPUs.
+	inline std::vector<std::vector<int>> numa_topology()
+	{
+		std::vector<std::vector<int>> nodes;
+#if defined(_WIN32)
+		for_each_processor_info(RelationNumaNode, [&nodes](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& info)
+		{
+			const DWORD node = info.NumaNode.NodeNumber;
+			if (nodes.size() <= node)
+				nodes.resize(node + 1);
+			append_group_mask(nodes[node], info.NumaNode.GroupMask);
+		});
+#elif defined(__linux__)
+		for (int node : sysfs_indices("/sys/devices/system/node", "node"))
+		{
+			if (nodes.size() <= static_cast<size_t>(node))
+				nodes.resize(node + 1);
+			nodes[node] = parse_cpu_list(read_sysfs(
+				"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+		}
+#endif
+		// Memory-only nodes have no CPUs to run workers on
+		nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+			[](const std::vector<int>& cpus) { return cpus.empty(); }), nodes.end());
+		if (nodes.empty())
+			nodes.push_back(all_cpus());
+		return nodes;
+	}
+
+	// Physical cores: the SMT siblings of every core. Falls back to one CPU per core.
+	inline std::vector<std::vector<int>> core_topology()
+	{
+		std::vector<std::vector<int>> cores;
+#if defined(_WIN32)
+		for_each_processor_info(RelationProcessorCore, [&cores](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& info)
+		{
+			cores.push_back(std::vector<int>());
+			for (WORD i = 0; i < info.Processor.GroupCount; ++i)
+				append_group_mask(cores.back(), info.Processor.GroupMask[i]);
+		});
+#elif defined(__linux__)
+		for (int cpu : sysfs_indices("/sys/devices/system/cpu", "cpu"))
+			cores.push_back(parse_cpu_list(read_sysfs("/sys/devices/system/cpu/cpu"
+				+ std::to_string(cpu) + "/topology/thread_siblings_list")));
+#endif
+		cores = unique_cpu_groups(cores);
+		if (cores.empty())
+			for (int cpu : all_cpus())
+				cores.push_back(std::vector<int>(1, cpu));
+		return cores;
+	}
+
+	// Last-level cache domains: the CPUs sharing each L3 (a CCX on AMD parts).
+	// Falls back to one domain holding all CPUs.
+	inline std::vector<std::vector<int>> l3_topology()
+	{
+		std::vector<std::vector<int>> domains;
+#if defined(_WIN32)
+		for_each_processor_info(RelationCache, [&domains](const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& info)
+		{
+			if (info.Cache.Level != 3)
+				return;
+			domains.push_back(std::vector<int>());
+			append_group_mask(domains.back(), info.Cache.GroupMask);
+		});
+#elif defined(__linux__)
+		for (int cpu : sysfs_indices("/sys/devices/system/cpu", "cpu"))
+		{
+			const std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/";
+			for (int index : sysfs_indices(base, "index"))
+			{
+				const std::string cache = base + "index" + std::to_string(index);
+				if (read_sysfs(cache + "/level") == "3")
+					domains.push_back(parse_cpu_list(read_sysfs(cache + "/shared_cpu_list")));
+			}
+		}
+#endif
+		domains = unique_cpu_groups(domains);
+		if (domains.empty())
+			domains.push_back(all_cpus());
+		return domains;
+	}
+
+	// Worker thread handle. std::thread takes no stack size, so with one set the
+	// thread is created natively on Windows and Linux; elsewhere it is ignored.
+	class WorkerThread
+	{
+	public:
+		typedef std::thread::native_handle_type native_handle_type;
+
+		WorkerThread() : native_(), native_running_(false) {}
+
+		WorkerThread(const WorkerThread&) = delete;
+		WorkerThread& operator=(const WorkerThread&) = delete;
+
+		~WorkerThread()
+		{
+			if (joinable())
+				std::terminate();  // Like std::thread
+		}
+
+		void start(size_t stack_size, std::function<void()> fn)
+		{
+#if defined(_WIN32) || defined(__linux__)
+			if (stack_size > 0)
+			{
+				std::unique_ptr<std::function<void()>> entry(new std::function<void()>(std::move(fn)));
+#if defined(_WIN32)
+				HANDLE handle = CreateThread(nullptr, stack_size, &WorkerThread::run, entry.get(),
+					STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+				if (!handle)
+					throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "CreateThread");
+				native_ = handle;
+#else
+				pthread_attr_t attr;
+				pthread_attr_init(&attr);
+				pthread_attr_setstacksize(&attr, std::max(stack_size, static_cast<size_t>(PTHREAD_STACK_MIN)));
+				const int error = pthread_create(&native_, &attr, &WorkerThread::run, entry.get());
+				pthread_attr_destroy(&attr);
+				if (error)
+					throw std::system_error(error, std::system_category(), "pthread_create");
+#endif
+				entry.release();
+				native_running_ = true;
+				return;
+			}
+#endif
+			(void)stack_size;
+			thread_ = std::thread(std::move(fn));
+		}
+
+		bool joinable() const { return native_running_ || thread_.joinable(); }
+
+		void join()
+		{
+			if (!native_running_)
+			{
+				thread_.join();
+				return;
+			}
+#if defined(_WIN32)
+			WaitForSingleObject(native_, INFINITE);
+			CloseHandle(native_);
+#elif defined(__linux__)
+			pthread_join(native_, nullptr);
+#endif
+			native_running_ = false;
+		}
+
+		native_handle_type native_handle() { return native_running_ ? native_ : thread_.native_handle(); }
+
+	private:
+#if defined(_WIN32)
+		static DWORD WINAPI run(LPVOID arg)
+#else
+		static void* run(void* arg)
+#endif
+		{
+			std::unique_ptr<std::function<void()>> entry(static_cast<std::function<void()>*>(arg));
+			(*entry)();
+			return 0;
+		}
+
+		std::thread thread_;
+		native_handle_type native_;
+		bool native_running_;
+	};
+
+	// Touch pages of the calling thread's stack, one frame per page, so the
+	// kernel maps them now instead of on the first deep call inside a task
+#if defined(_MSC_VER)
+	__declspec(noinline)
+#else
+	__attribute__((noinline))
+#endif
+	inline void prefault_stack(size_t pages)
+	{
+		volatile char page[4096];
+		page[0] = 0;
+		page[sizeof(page) - 1] = 0;
+		if (pages > 1)
+			prefault_stack(pages - 1);
+		page[0] = page[sizeof(page) - 1];
+	}
+
+	// schedule_every() state shared by the timer and the runs it posts
+	struct PeriodicTimer
+	{
+		std::function<void()> fn;
+		std::shared_ptr<CancelState> cancel;
+		unsigned long long period;  // In timer ticks, at least 1
+		std::atomic<bool> running{ false };  // A run is queued or executing
+	};
+
+	// One run of a periodic timer; clears the running flag however fn ends
+	struct PeriodicRun
+	{
+		std::shared_ptr<PeriodicTimer> timer;
+
+		void operator()()
+		{
+			struct Done
+			{
+				PeriodicTimer& timer;
+				~Done() { timer.running.store(false, std::memory_order_release); }
+			} done = { *timer };
+			timer->fn();
+		}
+	};
+
+	// A pending timer: a one-shot task, or a periodic timer re-armed after
+	// every firing
+	struct TimerNode
+	{
+		TimerNode* next;
+		unsigned long long tick;
+		Task task;
+		std::shared_ptr<PeriodicTimer> periodic;
+	};
+
+	// Hierarchical timer wheel over 64-bit ticks: 11 levels of 64 slots, a slot
+	// of level k spanning 64^k ticks. A timer sits on the level of the highest
+	// 6-bit group in which its tick differs from the current tick and moves down
+	// a level whenever its slot comes due. Inserting is O(1), every timer is
+	// moved at most 10 times, and one occupancy word per level finds the next
+	// slot to process with a bit scan however many timers are pending.
+	// Not thread-safe.
+	class TimerWheel
+	{
+	public:
+		static const unsigned level_bits = 6;
+		static const unsigned levels = 11;
+		static const unsigned slot_count = 1u << level_bits;
+		static const unsigned long long none = ~0ull;
+
+		TimerWheel() : now_(0), size_(0)
+		{
+			for (unsigned level = 0; level < levels; ++level)
+			{
+				occupied_[level] = 0;
+				for (unsigned slot = 0; slot < slot_count; ++slot)
+					slots_[level][slot] = nullptr;
+			}
+		}
+
+		~TimerWheel()
+		{
+			for (unsigned level = 0; level < levels; ++level)
+				for (unsigned slot = 0; slot < slot_count; ++slot)
+					destroy(take(level, slot));
+		}
+
+		TimerWheel(const TimerWheel&) = delete;
+		TimerWheel& operator=(const TimerWheel&) = delete;
+
+		size_t size() const { return size_; }
+
+		// Start at tick; only valid while empty
+		void reset(unsigned long long tick) { now_ = tick; }
+
+		// Add a timer; a tick already processed is due at the next expire()
+		void insert(TimerNode* node)
+		{
+			if (node->tick < now_)
+				node->tick = now_;
+			const unsigned long long differ = node->tick ^ now_;
+			const unsigned level = differ ? highest_bit(differ) / level_bits : 0;
+			const unsigned slot = static_cast<unsigned>(node->tick >> (level * level_bits)) & (slot_count - 1);
+			node->next = slots_[level][slot];
+			slots_[level][slot] = node;
+			occupied_[level] |= 1ull << slot;
+			size_++;
+		}
+
+		// First tick expire() has work at: the timers of a level-0 slot fall due,
+		// or a higher slot moves down; none while empty
+		unsigned long long next_tick() const
+		{
+			for (unsigned level = 0; level < levels; ++level)
+			{
+				const unsigned shift = level * level_bits;
+				const unsigned current = static_cast<unsigned>(now_ >> shift) & (slot_count - 1);
+				const unsigned long long pending = occupied_[level] & (~0ull << current);
+				if (!pending)
+					continue;
+				const unsigned upper = shift + level_bits;
+				const unsigned long long base = upper < 64 ? (now_ >> upper) << upper : 0;
+				const unsigned long long tick = base | (static_cast<unsigned long long>(lowest_bit(pending)) << shift);
+				return std::max(tick, now_);
+			}
+			return none;
+		}
+
+		// Append the timers due at or before tick to due and move past tick
+		void expire(unsigned long long tick, std::vector<TimerNode*>& due)
+		{
+			for (;;)
+			{
+				const unsigned long long next = next_tick();
+				if (next == none || next > tick)
+					break;
+				now_ = next;
+				// Slots of higher levels starting here move down first
+				for (unsigned level = levels - 1; level > 0; --level)
+				{
+					const unsigned shift = level * level_bits;
+					if (now_ & ((1ull << shift) - 1))
+						continue;
+					TimerNode* node = take(level, static_cast<unsigned>(now_ >> shift) & (slot_count - 1));
+					while (node)
+					{
+						TimerNode* following = node->next;
+						size_--;
+						insert(node);
+						node = following;
+					}
+				}
+				for (TimerNode* node = take(0, static_cast<unsigned>(now_) & (slot_count - 1)); node;)
+				{
+					TimerNode* following = node->next;
+					size_--;
+					due.push_back(node);
+					node = following;
+				}
+				now_ = next + 1;
+			}
+			if (tick >= now_)
+				now_ = tick + 1;
+		}
+
+	private:
+		static unsigned highest_bit(unsigned long long value)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+			unsigned bit = 0;
+			while (value >>= 1)
+				++bit;
+			return bit;
+#endif
+		}
+
+		static unsigned lowest_bit(unsigned long long value)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			return static_cast<unsigned>(__builtin_ctzll(value));
+#else
+			unsigned bit = 0;
+			while (!(value & 1))
+			{
+				value >>= 1;
+				++bit;
+			}
+			return bit;
+#endif
+		}
+
+		TimerNode* take(unsigned level, unsigned slot)
+		{
+			TimerNode* node = slots_[level][slot];
+			slots_[level][slot] = nullptr;
+			occupied_[level] &= ~(1ull << slot);
+			return node;
+		}
+
+		static void destroy(TimerNode* node)
+		{
+			while (node)
+			{
+				TimerNode* following = node->next;
+				delete node;
+				node = following;
+			}
+		}
+
+		unsigned long long now_;  // Ticks before now_ have been processed
+		size_t size_;
+		unsigned long long occupied_[levels];
+		TimerNode* slots_[levels][slot_count];
+	};
+
+	// Submission path for the library's own helper tasks (TaskGraph,
+	// parallel_for): they bypass admission control and are never shed
+	struct pool_access;
+}
+
+class ThreadPool
+{
+public:
+	// Thread priority enumeration
+	enum class Priority
+	{
+		LOW,
+		NORMAL,
+		HIGH,
+		REALTIME
+	};
+
+	// Per-task priority: workers always take the highest non-empty level first
+	enum class TaskPriority
+	{
+		LOW,
+		NORMAL,
+		HIGH,
+		CRITICAL
+	};
+
+	// Logical CPUs a thread may run on (Linux CPU ids, on Windows
+	// group * 64 + processor number)
+	typedef std::vector<int> CpuSet;
+
+	// Memory for heap-stored tasks, promise states and bulk states
+	typedef thread_pool_detail::AllocatorHooks AllocatorHooks;
+
+	class CancellationSource;
+
+	// Read side of a cancellation flag; a default-constructed token is never cancelled
+	class CancellationToken
+	{
+	public:
+		CancellationToken() noexcept {}
+
+		bool is_cancelled() const noexcept
+		{
+			return state_ && state_->cancelled.load(std::memory_order_acquire);
+		}
+
+		explicit operator bool() const noexcept { return static_cast<bool>(state_); }
+
+	private:
+		friend class ThreadPool;
+		friend class CancellationSource;
+
+		explicit CancellationToken(std::shared_ptr<thread_pool_detail::CancelState> state) noexcept
+			: state_(std::move(state)) {}
+
+		std::shared_ptr<thread_pool_detail::CancelState> state_;
+	};
+
+	// Owner of a cancellation flag: cancel() makes every task submitted with
+	// one of its tokens drop out of the queues
+	class CancellationSource
+	{
+	public:
+		CancellationSource() : state_(thread_pool_detail::make_shared_state<thread_pool_detail::CancelState>()) {}
+
+		CancellationToken token() const noexcept { return CancellationToken(state_); }
+		void cancel() noexcept { state_->cancelled.store(true, std::memory_order_release); }
+		bool is_cancelled() const noexcept { return state_->cancelled.load(std::memory_order_acquire); }
+
+	private:
+		std::shared_ptr<thread_pool_detail::CancelState> state_;
+	};
+
+	// Error stored in the future of a task that was dropped without running
+	class TaskCancelled : public std::runtime_error
+	{
+	public:
+		enum class Reason
+		{
+			CANCELLED,  // TaskOptions::cancel was cancelled
+			EXPIRED,    // TaskOptions::deadline passed
+			TAG,        // cancel_tag() for TaskOptions::tag
+			DROPPED     // Shed by OverflowPolicy::DROP_OLDEST
+		};
+
+		explicit TaskCancelled(Reason reason)
+			: std::runtime_error(reason == Reason::EXPIRED ? "task deadline expired"
+				: reason == Reason::TAG ? "task tag cancelled"
+				: reason == Reason::DROPPED ? "task dropped on queue overflow" : "task cancelled"),
+			reason_(reason) {}
+
+		Reason reason() const noexcept { return reason_; }
+
+	private:
+		Reason reason_;
+	};
+
+	// Thrown by enqueue()/post() when Options::max_pending is reached and the
+	// overflow policy gives up
+	class QueueFull : public std::runtime_error
+	{
+	public:
+		QueueFull() : std::runtime_error("ThreadPool queue full") {}
+	};
+
+	// What a submission beyond Options::max_pending does
+	enum class OverflowPolicy
+	{
+		BLOCK,        // Wait for room (up to Options::block_timeout), then throw QueueFull
+		REJECT,       // Throw QueueFull right away
+		CALLER_RUNS,  // Run the task on the submitting thread
+		DROP_OLDEST   // Shed the oldest queued enqueue()/post() task (TaskCancelled::Reason::DROPPED);
+		              // in LOCK_FREE mode only non-NORMAL priority ones, else wait as BLOCK
+	};
+
+	// Per-task submission options
+	struct TaskOptions
+	{
+		TaskPriority priority = TaskPriority::NORMAL;
+		int node = -1;  // NUMA node hint (Options::numa_aware), -1: no preference
+		const char* tag = nullptr;  // Name reported to trace hooks and cancel_tag() (must outlive the task)
+
+		// Checked when the task is dequeued: a cancelled or expired task is
+		// dropped without being called and its future gets TaskCancelled
+		CancellationToken cancel;
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	};
+
+	// Tracing: what a hook is told. worker is the slot index, time_ns is
+	// steady_clock in nanoseconds.
+	struct TraceEvent
+	{
+		size_t worker;
+		const char* tag;  // TaskOptions::tag, nullptr for untagged tasks and idle events
+		long long time_ns;
+	};
+
+	// Tracing callbacks, called on the worker thread. Unset hooks cost one
+	// pointer check per task.
+	struct TraceHooks
+	{
+		std::function<void(const TraceEvent&)> on_task_begin;
+		std::function<void(const TraceEvent&)> on_task_end;
+		std::function<void(const TraceEvent&)> on_idle;  // Worker about to park
+		std::function<void(const TraceEvent&)> on_wake;  // Worker back from parking
+	};
+
+	// Task scheduling strategy
+	enum class Scheduling
+	{
+		SHARED_QUEUE,   // One FIFO queue guarded by queue_mutex (default)
+		WORK_STEALING,  // Per-worker deques, idle workers steal from each other
+		LOCK_FREE       // Bounded lock-free ring buffer, see Options::queue_capacity
+	};
+
+	// Idle worker strategy: spin with a pause hint, then yield, then park
+	struct IdlePolicy
+	{
+		unsigned spin_count = 256;
+		unsigned yield_count = 0;
+
+		// Park immediately (lowest CPU use, a futex wake per task to an idle pool)
+		static IdlePolicy park()
+		{
+			IdlePolicy policy;
+			policy.spin_count = 0;
+			return policy;
+		}
+
+		// Stay hot for a long time before parking (burns CPU while idle)
+		static IdlePolicy low_latency()
+		{
+			IdlePolicy policy;
+			policy.spin_count = 1u << 16;
+			policy.yield_count = 1u << 10;
+			return policy;
+		}
+	};
+
+	// Advanced construction options
+	struct Options
+	{
+		Scheduling scheduling = Scheduling::SHARED_QUEUE;
+
+		// Ring buffer size for Scheduling::LOCK_FREE (rounded up to a power of two)
+		size_t queue_capacity = 1024;
+
+		// Anti-starvation aging: a waiting priority level is served at the latest
+		// after this many pops from higher levels (0 disables aging)
+		size_t priority_aging = 16;
+
+		// What a worker does when it runs out of tasks
+		IdlePolicy idle;
+
+		// Dynamic sizing bounds (0: the threads constructor argument). Between
+		// them the pool grows while a backlog persists for grow_after with no
+		// idle worker, and shrinks when a worker stays idle for idle_timeout.
+		size_t min_threads = 0;
+		size_t max_threads = 0;
+		std::chrono::milliseconds grow_after = std::chrono::milliseconds(5);
+		std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(0);  // 0: never shrink
+
+		// NUMA-aware work stealing: one queue and worker group per node, stealing
+		// prefers the own node. Implies Scheduling::WORK_STEALING. Without
+		// cpu_affinity, workers are spread over the nodes and pinned to them.
+		bool numa_aware = false;
+
+		// Per-worker CPU sets: worker i may run on any CPU of
+		// worker_cpus[i % worker_cpus.size()]. Takes precedence over cpu_affinity.
+		// On Windows a set must not span processor groups.
+		std::vector<CpuSet> worker_cpus;
+
+		// Batched dequeue: a worker moves up to this many tasks from the shared
+		// queue (or its NUMA node queue) into its own deque per lock acquisition,
+		// never more than its fair share of the backlog. Idle workers steal from
+		// those deques. HIGH and CRITICAL tasks are not batched and go before a
+		// worker's batch. 0 or 1: one task at a time.
+		size_t dequeue_batch = 0;
+
+		// Admission control for enqueue(), post() and enqueue_bulk(): at most
+		// max_pending tasks queued or running, checked on submission (concurrent
+		// producers may overshoot by one each). 0: unbounded. try_enqueue()
+		// returns an invalid future instead of applying the policy. BLOCK only
+		// holds up outside producers: a task submitting more work is never made
+		// to wait (that could deadlock), it goes over the limit.
+		size_t max_pending = 0;
+		OverflowPolicy overflow = OverflowPolicy::BLOCK;
+		std::chrono::milliseconds block_timeout = std::chrono::milliseconds(0);  // 0: no timeout
+
+		// Backpressure signal: on_watermark(true) once pending tasks reach
+		// high_watermark, on_watermark(false) once they fall to low_watermark.
+		// Called on the submitting or completing thread; must not block or submit.
+		size_t high_watermark = 0;  // 0: disabled
+		size_t low_watermark = 0;
+		std::function<void(bool above)> on_watermark;
+
+		// Start no worker in the constructor: a submission that finds no idle
+		// worker starts one more, up to the thread count, and warm_up() or
+		// resize() start the rest. size() reports the full count meanwhile.
+		bool lazy_start = false;
+
+		// Worker stack size in bytes (0: platform default). Honoured on Windows
+		// and Linux, where workers are then created without std::thread.
+		size_t stack_size = 0;
+
+		// Stack pre-faulted on every worker by warm_up(), at most half of
+		// stack_size when that is set
+		size_t warm_stack = 64 * 1024;
+
+		// Tick of the timer wheel behind enqueue_after(), enqueue_at() and
+		// schedule_every(): timers fire at most this late, never early
+		std::chrono::microseconds timer_resolution = std::chrono::milliseconds(1);
+
+		// Workers BlockingScope and enqueue_blocking() may add on top of the
+		// thread count at a time (0: as many as the pool has threads). Blocking
+		// regions beyond that run uncompensated.
+		size_t max_compensation = 0;
+	};
+
+	// Constructor with optional parameters: CPU affinity and priority
+	ThreadPool(size_t threads,
+		const std::vector<int>& cpu_affinity = {},
+		Priority priority = Priority::NORMAL);
+
+	// Constructor with numerical priority
+	ThreadPool(size_t threads,
+		const std::vector<int>& cpu_affinity,
+		int custom_priority);
+
+	// Constructors with advanced options
+	ThreadPool(size_t threads,
+		const std::vector<int>& cpu_affinity,
+		Priority priority,
+		const Options& options);
+
+	ThreadPool(size_t threads,
+		const std::vector<int>& cpu_affinity,
+		int custom_priority,
+		const Options& options);
+
+	template<class F, class... Args>
+	auto enqueue(F&& f, Args&&... args)
+		-> typename thread_pool_detail::task_future<F, Args...>::type;
+
+	// Enqueue with a per-task priority level
+	template<class F, class... Args>
+	auto enqueue(TaskPriority priority, F&& f, Args&&... args)
+		-> typename thread_pool_detail::task_future<F, Args...>::type;
+
+	// Enqueue with per-task options (priority, NUMA node hint)
+	template<class F, class... Args>
+	auto enqueue(const TaskOptions& options, F&& f, Args&&... args)
+		-> typename thread_pool_detail::task_future<F, Args...>::type;
+
+	// Like enqueue, but returns an invalid future (valid() == false) instead of
+	// waiting when a bounded queue is full
+	template<class F, class... Args>
+	auto try_enqueue(F&& f, Args&&... args)
+		-> typename thread_pool_detail::task_future<F, Args...>::type;
+
+	// Bulk submission of a range of callables: one queue lock and one round of
+	// wakeups for the whole batch
+	template<class InputIt>
+	auto enqueue_bulk(InputIt first, InputIt last)
+		-> std::vector<std::future<typename thread_pool_detail::invoke_result<
+			typename std::iterator_traits<InputIt>::reference>::type>>;
+
+	// Bulk submission of f(0) ... f(count - 1); the returned future completes when
+	// all calls have finished and carries the first exception thrown, if any
+	template<class F>
+	std::future<void> enqueue_bulk(size_t count, F&& f);
+
+	// Fire-and-forget submission: no future/promise is created. Exceptions escaping
+	// the callable are passed to the exception handler.
+	template<class F, class... Args>
+	auto post(F&& f, Args&&... args)
+		-> typename thread_pool_detail::enable_if_callable<F>::type;
+
+	// Fire-and-forget submission with a per-task priority level
+	template<class F, class... Args>
+	void post(TaskPriority priority, F&& f, Args&&... args);
+
+	// Fire-and-forget submission with per-task options
+	template<class F, class... Args>
+	void post(const TaskOptions& options, F&& f, Args&&... args);
+
+	// Run f(args...) once delay has passed. Timers live in a timer wheel inside
+	// the pool: one parked worker sleeps until the next timer is due, busy
+	// workers check between tasks. drain() does not wait for timers that have
+	// not fired; the future of a timer still pending when the pool is destroyed
+	// reports broken_promise.
+	template<class Rep, class Period, class F, class... Args>
+	auto enqueue_after(std::chrono::duration<Rep, Period> delay, F&& f, Args&&... args)
+		-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>;
+
+	// Run f(args...) at time (of any clock, measured against it now)
+	template<class Clock, class Duration, class F, class... Args>
+	auto enqueue_at(const std::chrono::time_point<Clock, Duration>& time, F&& f, Args&&... args)
+		-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>;
+
+	// Post f() every period, first after one period, at fixed rate: runs stay on
+	// the grid of the first deadline however late one of them starts. A run
+	// that falls due while the previous one is still queued or executing is
+	// skipped. Exceptions go to the exception handler. Cancel the returned
+	// source to stop the schedule.
+	template<class Rep, class Period, class F>
+	CancellationSource schedule_every(std::chrono::duration<Rep, Period> period, F&& f);
+
+#if defined(THREAD_POOL_COROUTINES)
+	// Awaitable resuming the awaiting coroutine on a worker: co_await pool.schedule();
+	class ScheduleAwaiter
+	{
+	public:
+		explicit ScheduleAwaiter(ThreadPool& pool) noexcept : pool_(&pool) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { pool_->push_task(Task(handle)); }
+		void await_resume() const noexcept {}
+
+	private:
+		ThreadPool* pool_;
+	};
+
+	ScheduleAwaiter schedule() noexcept { return ScheduleAwaiter(*this); }
+#endif
+
+	// Marks a region of a task as blocking (disk reads, RPCs, waiting on
+	// something outside the pool). While it lives the pool runs one extra
+	// worker, so queued tasks keep the cores busy; once it ends the extra
+	// worker exits between two tasks. Creating one starts a thread, so keep it
+	// for calls that block much longer than that. No effect outside the pool's
+	// workers and in nested scopes.
+	class BlockingScope
+	{
+	public:
+		explicit BlockingScope(ThreadPool& pool);
+		~BlockingScope();
+
+		BlockingScope(const BlockingScope&) = delete;
+		BlockingScope& operator=(const BlockingScope&) = delete;
+
+	private:
+		ThreadPool* pool_;  // nullptr: nothing to give back
+	};
+
+	// enqueue() for a task that blocks: it runs inside a BlockingScope
+	template<class F, class... Args>
+	auto enqueue_blocking(F&& f, Args&&... args)
+		-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>;
+
+	// Install tracing hooks (empty TraceHooks to remove them). Takes effect for
+	// the next task each worker runs; the replaced hooks are destroyed once no
+	// thread is still calling them.
+	void set_trace_hooks(const TraceHooks& hooks);
+
+	// Replace the allocator used for task storage (nullptr: the built-in
+	// thread-local slab arena). Process-wide, and may change at any time: a
+	// block is always freed by the hooks that allocated it, so hooks must stay
+	// valid while blocks they handed out are alive.
+	static void set_allocator(const AllocatorHooks* hooks);
+
+	// Drop every queued task submitted with this tag (compared by content)
+	// before the call: they are skipped when dequeued, as if cancelled. Tasks
+	// already running or submitted later are not affected.
+	void cancel_tag(const char* tag);
+
+	// Handler for exceptions escaping posted tasks (default: report to std::cerr)
+	void set_exception_handler(std::function<void(std::exception_ptr)> handler);
+
+	~ThreadPool();
+
+	// Wait for all tasks to complete (drain)
+	void drain();
+
+	// Wait for all other tasks to complete, running queued tasks meanwhile.
+	// Safe inside a task: tasks on the stack of threads in drain_and_help()
+	// (such as the caller's own) do not count.
+	void drain_and_help();
+
+	// Wait for future (std::future, std::shared_future or TaskFuture), running
+	// queued tasks meanwhile instead of blocking. Safe inside a task, e.g. for
+	// nested parallelism that waits on its own subtasks.
+	template<class Future>
+	void wait(const Future& future);
+
+	// Number of worker threads, not counting those standing in for blocked ones
+	size_t size() const;
+
+	// Start every worker that is not running yet and have each one pre-fault
+	// Options::warm_stack of its stack and its thread-local task allocator
+	// between two tasks; returns when all have done so. Call it during service
+	// start so the first requests do not pay for page faults and slab setup.
+	void warm_up();
+
+	// Set the number of worker threads, at most max(threads, Options::max_threads).
+	// Extra workers exit once they are idle; automatic sizing continues from n.
+	void resize(size_t threads);
+
+	// Pause (false) or resume the automatic sizing between Options::min_threads
+	// and max_threads, e.g. while an outside controller such as AutoTuner
+	// drives resize()
+	void set_auto_sizing(bool enabled);
+
+	// Automatic sizing is configured and not paused
+	bool auto_sizing() const { return dynamic_.load(std::memory_order_relaxed); }
+
+	// Approximate number of workers currently parked waiting for work (plus
+	// those a lazy pool has not started yet)
+	size_t idle_workers() const;
+
+	// Latency distribution in nanoseconds (percentiles within 1/16)
+	struct LatencyStats
+	{
+		unsigned long long count = 0;
+		double mean_ns = 0;
+		unsigned long long p50_ns = 0;
+		unsigned long long p90_ns = 0;
+		unsigned long long p99_ns = 0;
+		unsigned long long p999_ns = 0;
+		unsigned long long max_ns = 0;
+	};
+
+	struct WorkerStats
+	{
+		bool active = false;      // Slot below the current target size
+		size_t queued = 0;        // Tasks in the worker's deque (work stealing)
+		unsigned long long tasks_executed = 0;
+		unsigned long long steals = 0;  // Tasks taken from another worker's deque
+		double utilization = 0;   // Time spent running tasks since the worker started (0..1)
+		LatencyStats queue_wait;  // Submission to start of execution
+		LatencyStats run_time;    // Execution time
+	};
+
+	// Snapshot of the pool. Queue state is always available; task counts,
+	// latencies and utilization need THREAD_POOL_METRICS (metrics_enabled).
+	struct Stats
+	{
+		bool metrics_enabled = false;
+		size_t threads = 0;       // Current target size
+		size_t idle_workers = 0;
+		size_t queued = 0;        // Tasks waiting in any queue
+		size_t pending = 0;       // Tasks queued or running
+		unsigned long long tasks_executed = 0;
+		unsigned long long tasks_cancelled = 0;  // Dropped at dequeue (always counted)
+		LatencyStats queue_wait;
+		LatencyStats run_time;
+		std::vector<WorkerStats> workers;
+	};
+
+	// Relaxed snapshot: counters are read one by one while the pool runs
+	Stats stats() const;
+
+	// True when called from one of this pool's worker threads
+	bool is_worker_thread() const;
+
+	// CPU topology, for building cpu_affinity lists and Options::worker_cpus
+	static std::vector<CpuSet> physical_cores();  // SMT siblings per core
+	static std::vector<CpuSet> l3_domains();      // CPUs sharing an L3 cache
+	static std::vector<CpuSet> numa_domains();    // CPUs per NUMA node
+
+	// All CPUs ordered so consecutive workers land on different physical cores:
+	// the first SMT thread of every core, then the second ones, and so on
+	static std::vector<int> smt_spread_order();
+
+	// NUMA nodes the workers are grouped by (1 unless Options::numa_aware)
+	size_t numa_nodes() const;
+
+	// Node of the calling worker thread, -1 for threads outside the pool
+	int current_numa_node() const;
+
+private:
+	typedef thread_pool_detail::Task Task;
+
+	// Per-worker state: thread handle and (work-stealing mode) local deque.
+	// Every worker is a heap block of its own. The leading pad keeps the deque
+	// and its length, which thieves poll, off any line of the neighbouring
+	// block; the owner's per-task writes sit a line further down.
+	struct Worker
+	{
+		char pad0_[thread_pool_detail::cache_line_size];
+		std::mutex mutex;
+		std::deque<Task> tasks;
+		std::atomic<size_t> size{ 0 };  // Deque length, readable without the lock
+		char pad1_[thread_pool_detail::cache_line_size];
+		size_t pops = 0;  // Tasks taken, drives aging of injected LOW tasks
+		std::atomic<unsigned> trace_pins{ 0 };  // Trace hook sets in use by this worker
+#if defined(THREAD_POOL_METRICS)
+		thread_pool_detail::WorkerMetrics metrics;
+#endif
+		std::atomic<bool> warm{ false };  // warm_up() pending (set under resize_mutex_)
+		thread_pool_detail::WorkerThread thread;
+		bool running = false;  // Thread started and not retired (resize_mutex_)
+		size_t node = 0;  // NUMA node the worker belongs to
+		std::vector<size_t> victims;  // Steal order: own node first
+		size_t local_victims = 0;  // Leading entries of victims on the own node
+	};
+
+	// NUMA mode: tasks submitted for a node but not yet taken by one of its
+	// workers. Padded like Worker, one heap block per node.
+	struct NodeQueue
+	{
+		char pad0_[thread_pool_detail::cache_line_size];
+		std::mutex mutex;
+		std::deque<Task> tasks;
+		std::atomic<size_t> size{ 0 };
+		std::vector<int> cpus;
+	};
+
+	// Identity of the pool worker running on the current thread
+	struct WorkerContext
+	{
+		ThreadPool* pool;
+		size_t index;
+		bool blocking;  // Inside a compensated BlockingScope
+	};
+	static WorkerContext& current_worker();
+
+	// Tasks being run by help_one() on the current thread, innermost first
+	struct HelpFrame
+	{
+		const ThreadPool* pool;
+		HelpFrame* next;
+	};
+	static HelpFrame*& help_frames();
+
+	// Run one queued task on the calling thread; false if none was found
+	bool help_one();
+
+	// Non-blocking fetch for a thread that is not one of the workers
+	bool try_get_external(Task& task);
+
+	// Tasks of this pool on the calling thread's stack
+	size_t tasks_on_stack() const;
+
+	// Start worker threads (shared by all constructors)
+	void start_workers(size_t threads);
+
+	// Start the workers of slots below target_threads_ that are not running
+	// (requires resize_mutex_)
+	void spawn_workers();
+
+	// Dynamic sizing: add a worker when the backlog has persisted without idle workers
+	void maybe_grow();
+
+	// Options::lazy_start: start up to count more workers while below the thread count
+	void start_on_demand(size_t count);
+
+	// Pre-fault the calling worker's stack and allocator for warm_up()
+	void warm_worker(size_t index);
+
+	// warm_up() no longer waits for the worker in this slot
+	void clear_warm(Worker& worker);
+
+	// Steady clock nanoseconds delay from now, saturated for far-off deadlines
+	template<class Rep, class Period>
+	static long long timer_deadline(std::chrono::duration<Rep, Period> delay);
+
+	// Arm a timer for deadline_ns and wake the worker that waits for timers
+	// if it now has to wake earlier
+	void add_timer(thread_pool_detail::TimerNode* node, long long deadline_ns);
+
+	// Queue the tasks of every due timer and re-arm periodic ones
+	void run_timers();
+
+	// A timer is due (cheap while none is pending)
+	bool timers_due() const;
+
+	// Wake-up time of a wheel tick, LLONG_MAX for none
+	long long timer_wake_ns(unsigned long long tick) const;
+
+	// Dynamic sizing: an idle worker timed out, lower the target by one
+	void shrink_idle();
+
+	// BlockingScope: one more worker while a worker blocks; false if none
+	// was added
+	bool begin_blocking();
+	void end_blocking();
+
+	// Leave the pool if the slot is above the target; false if it is needed again
+	bool try_retire(size_t index);
+
+	// Worker thread main loop
+	void worker_loop(size_t index);
+
+	// Run a dequeued task and account for its completion
+	void run_task(Task& task);
+
+	// Wrap fn with the options checked at dequeue time (or a trace tag), if any
+	template<class Fn>
+	Task make_task(const TaskOptions& options, Fn&& fn);
+
+	// Drop a cancelled or expired task instead of running it; false if it should run
+	bool discard_task(Task& task, const thread_pool_detail::TaskGuard& guard);
+
+	// Admission control for count new tasks (Options::max_pending). Waits,
+	// throws QueueFull or sheds queued tasks as configured; false if the tasks
+	// are to run on the calling thread instead.
+	bool admit(size_t count);
+
+	// Run a task that was not queued on the calling thread
+	void run_inline(Task& task);
+
+	// BLOCK policy: wait until count more tasks fit, false on timeout. Tasks
+	// submitting from inside the pool are let through right away.
+	bool wait_for_space(size_t count);
+
+	// DROP_OLDEST policy: shed up to count queued tasks, returns how many
+	size_t drop_oldest(size_t count);
+	bool take_droppable(Task& task);
+	static bool is_droppable(const Task& task);
+
+	// Report a watermark crossing to Options::on_watermark (once per crossing)
+	void signal_watermark(bool above);
+
+	// True if cancel_tag(tag) was called after a task with this tag got epoch
+	bool tag_cancelled(const char* tag, unsigned long long epoch);
+
+	// Event for the calling thread (worker index, or SIZE_MAX outside the pool)
+	TraceEvent trace_event(const char* tag) const;
+
+	// Current trace hooks, nullptr if none, pinned in pins (the calling
+	// thread's counter) until unpin_trace_hooks()
+	std::atomic<unsigned>& trace_pins();
+	const TraceHooks* pin_trace_hooks(std::atomic<unsigned>& pins);
+	void unpin_trace_hooks(std::atomic<unsigned>& pins);
+	// Free the replaced hook sets unless a thread holds a pin (handler_mutex_ held)
+	void reclaim_trace_hooks();
+
+	// Percentiles of summed histogram buckets
+	static LatencyStats latency_stats(const std::vector<unsigned long long>& counts,
+		unsigned long long total, unsigned long long max);
+
+	// Account for count finished (or withdrawn) tasks, waking drain() on zero
+	void finish_tasks(size_t count);
+
+	// Report an exception that escaped a posted task
+	void handle_exception(std::exception_ptr error);
+
+	// Queue a wrapped task according to the scheduling mode
+	void push_task(Task&& task);
+	void push_task(Task&& task, const TaskOptions& options);
+
+	// Build NUMA node queues and per-worker steal orders
+	void setup_nodes();
+
+	// NUMA mode: take the oldest task of a node queue; a batch when worker is given
+	bool pop_node(size_t node, Task& task, Worker* worker = nullptr);
+
+	// Shared queue mode with Options::dequeue_batch: take the next task and
+	// move a batch behind it into the worker's deque
+	bool pop_shared_batch(Worker& worker, Task& task);
+
+	// Tasks to take from a shared queue holding depth tasks
+	size_t dequeue_batch_size(size_t depth) const;
+
+	// Work-stealing/lock-free modes: take a prioritized task from the shared
+	// multi-level queue that workers check around their regular source
+	bool pop_injected(Task& task, bool urgent_only);
+
+	// Republish urgent_size_ after a change to `tasks` (requires queue_mutex)
+	void count_urgent();
+
+	// Queue a task unless a bounded queue is full
+	bool try_push_task(Task&& task);
+
+	// Non-blocking fetch of the next task for a worker
+	bool try_get_task(size_t index, Task& task);
+
+	// True if a worker would find something to do (no lock needed)
+	bool has_work() const;
+
+	// Idle worker: spin/yield as configured by Options::idle, then park on
+	// condition. Returns false once the pool is stopping and no work is left.
+	bool wait_for_work(size_t index);
+
+	// Queue a batch of tasks with one lock acquisition per target queue
+	void push_tasks(std::vector<Task>& batch);
+
+	// Wake up to count idle workers for newly published tasks
+	void wake_workers(size_t count);
+
+	// Work-stealing mode: pop from own deque, then steal from the others
+	bool pop_task(size_t index, Task& task);
+	bool steal_task(Worker& victim, Task& task);
+
+	// Set thread CPU affinity function
+	void set_thread_affinity(thread_pool_detail::WorkerThread& thread, int cpu_core);
+
+	// Set thread CPU affinity to a set of cores (e.g. a NUMA node)
+	void set_thread_affinity(thread_pool_detail::WorkerThread& thread, const CpuSet& cpu_cores);
+
+	// CPUs a worker is pinned to (empty: not pinned)
+	CpuSet worker_cpu_set(size_t index) const;
+
+	// Set thread priority function (enumeration version)
+	void set_thread_priority(thread_pool_detail::WorkerThread& thread, Priority priority);
+
+	// Set thread priority function (numerical version)
+	void set_thread_priority(thread_pool_detail::WorkerThread& thread, int custom_priority);
+
+	// Layout: members are grouped by who writes them. The groups written on
+	// every submission, dequeue, park or completion are kept a cache line
+	// apart from each other and from the read-mostly part, so producers,
+	// consumers and drain() waiters do not keep stealing each other's lines.
+	//
+	// The pads are char arrays, not alignas: C++11 new ignores over-alignment,
+	// so the pool itself is not line aligned. The pads therefore promise a
+	// distance, not line boundaries. The hot groups never share a line with
+	// each other, and not with neighbouring objects either, as the read-mostly
+	// part leads and completion_pad2_ trails. The read-mostly part, though,
+	// may share its first line with whatever precedes the pool. The gain
+	// depends on the machine. It was measured on one CPU only, where lines
+	// are not contended, so the effect on multi-socket hosts is untested.
+
+	// Read-mostly: configuration, worker slots and state changed only by rare
+	// calls (resize, cancel_tag, hooks, admission waits)
+	std::vector<std::unique_ptr<Worker>> workers;  // Thread collection (for joining)
+	std::atomic<bool> stop;
+
+	// Stored configurations
+	std::vector<int> cpu_affinity_;
+	Priority priority_;
+	int custom_priority_;
+	bool use_custom_priority_;
+	Options options_;
+
+	// Handler for exceptions escaping posted tasks
+	std::mutex handler_mutex_;
+	std::function<void(std::exception_ptr)> exception_handler_;
+
+	// Tracing: threads read the current hooks lock-free and pin them while
+	// calling them. Replaced hook sets are freed once no thread holds a pin.
+	std::atomic<const TraceHooks*> trace_hooks_{ nullptr };
+	std::vector<std::unique_ptr<TraceHooks>> trace_history_;  // Current and replaced sets, handler_mutex_
+	std::atomic<bool> trace_retired_{ false };  // trace_history_ holds replaced sets
+	std::atomic<unsigned> trace_pins_{ 0 };  // Pins of threads that are not workers
+
+	// NUMA mode node queues
+	std::vector<std::unique_ptr<NodeQueue>> nodes_;
+
+	// Lock-free mode ring buffer (padded internally)
+	std::unique_ptr<thread_pool_detail::MpmcQueue<Task>> ring_;
+
+	// Cancellation: latest cancel_tag() epoch per tag, bumped on every call
+	std::mutex cancel_mutex_;
+	std::vector<std::pair<std::string, unsigned long long>> cancelled_tags_;  // cancel_mutex_
+	std::atomic<unsigned long long> cancel_epoch_{ 0 };
+	std::atomic<unsigned long long> tasks_cancelled_{ 0 };
+
+	// Admission control and watermarks
+	std::mutex space_mutex_;
+	std::condition_variable space_cond_;     // Room below max_pending again
+	std::atomic<size_t> space_waiters_{ 0 };  // Producers blocked in wait_for_space()
+	std::mutex watermark_mutex_;
+	std::atomic<bool> above_watermark_{ false };
+
+	friend struct thread_pool_detail::pool_access;
+
+	// Dynamic sizing: workers occupy slots [0, target_threads_) of `workers`
+	std::mutex resize_mutex_;
+	std::atomic<size_t> target_threads_{ 0 };
+	size_t min_threads_ = 0;
+	size_t max_threads_ = 0;
+	bool auto_sizing_ = false;  // Configured: grow_after/idle_timeout apply
+	std::atomic<bool> dynamic_{ false };  // auto_sizing_ and not paused
+	std::atomic<bool> lazy_{ false };  // Options::lazy_start, not all workers started yet
+	size_t lazy_threads_ = 0;  // Thread count the lazy start works towards
+	size_t compensation_slots_ = 0;  // Trailing slots reserved for Options::max_compensation
+	std::atomic<size_t> compensating_{ 0 };  // Workers added by live BlockingScopes
+	std::mutex warm_mutex_;
+	std::condition_variable warm_cond_;
+
+	// Timers: the wheel under timer_mutex_, its next wake-up readable without
+	// it. One parked worker, the keeper, waits on timer_cond_ until then.
+	std::mutex timer_mutex_;
+	thread_pool_detail::TimerWheel timers_;
+	long long timer_tick_ns_ = 1000000;
+	std::condition_variable timer_cond_;
+	std::atomic<long long> next_timer_ns_{ LLONG_MAX };  // Read by every worker between tasks
+
+	// Shared queue: producers and consumers meet here under queue_mutex. The
+	// queue is the only one in shared queue mode and holds prioritized
+	// (non-NORMAL) tasks in the other modes.
+	char queue_pad_[thread_pool_detail::cache_line_size];
+	std::mutex queue_mutex;
+	std::condition_variable condition;
+	thread_pool_detail::PriorityQueue<Task> tasks;
+	std::atomic<size_t> tasks_size_{ 0 };  // Length of `tasks`, readable without the lock
+	std::atomic<size_t> urgent_size_{ 0 };  // Its HIGH and CRITICAL tasks, see count_urgent()
+	bool timer_keeper_ = false;  // Guarded by queue_mutex
+
+	// Idle workers: written when a worker spins or parks, read by every
+	// producer deciding whom to wake
+	char idle_pad_[thread_pool_detail::cache_line_size];
+	std::atomic<size_t> sleepers_{ 0 };     // Workers parked on condition (all modes)
+	std::atomic<size_t> spinning_{ 0 };     // Idle workers spinning before they park
+	std::atomic<long long> backlog_since_{ 0 };  // steady_clock ticks, 0: no backlog seen
+
+	// Submission bookkeeping of the work-stealing and NUMA modes
+	char submit_pad_[thread_pool_detail::cache_line_size];
+	std::atomic<size_t> next_victim_{ 0 };  // Round-robin target for external submissions
+	std::atomic<size_t> next_node_{ 0 };    // Round-robin node for unhinted submissions
+	std::atomic<size_t> queued_{ 0 };       // Tasks sitting in worker deques
+	std::atomic<size_t> node_queued_{ 0 };  // Tasks in all node queues
+
+	// Task counter and completion condition variable. The counter gets a cache
+	// line of its own: every enqueue and every completion writes it, it must not
+	// invalidate the line that drain() waiters and the other groups read.
+	char completion_pad0_[thread_pool_detail::cache_line_size];
+	std::atomic<size_t> task_count_{ 0 };  // Atomic counter for unfinished tasks
+	char completion_pad1_[thread_pool_detail::cache_line_size - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> drain_waiters_{ 0 };  // Threads blocked in drain()
+	std::atomic<size_t> blocked_tasks_{ 0 };  // tasks_on_stack() of threads in drain_and_help()
+	std::mutex drain_mutex_;
+	std::condition_variable task_done_cond_;  // Notification for task completion
+	char completion_pad2_[thread_pool_detail::cache_line_size];
+};
+
+// Constructor implementation
+inline ThreadPool::ThreadPool(size_t threads,
+	const std::vector<int>& cpu_affinity,
+	Priority priority)
+	: ThreadPool(threads, cpu_affinity, priority, Options())
+{
+}
+
+// constructor (numerical priority)
+inline ThreadPool::ThreadPool(size_t threads,
+	const std::vector<int>& cpu_affinity,
+	int custom_priority)
+	: ThreadPool(threads, cpu_affinity, custom_priority, Options())
+{
+}
+
+// Constructor (advanced options)
+inline ThreadPool::ThreadPool(size_t threads,
+	const std::vector<int>& cpu_affinity,
+	Priority priority,
+	const Options& options)
+	: stop(false), cpu_affinity_(cpu_affinity), priority_(priority),
+	custom_priority_(0), use_custom_priority_(false), options_(options)
+{
+	if (options_.numa_aware)
+		options_.scheduling = Scheduling::WORK_STEALING;
+	tasks.set_aging_limit(options_.priority_aging);
+	if (options_.scheduling == Scheduling::LOCK_FREE)
+		ring_.reset(new thread_pool_detail::MpmcQueue<Task>(options_.queue_capacity));
+	start_workers(threads);
+}
+
+// Constructor (numerical priority, advanced options)
+inline ThreadPool::ThreadPool(size_t threads,
+	const std::vector<int>& cpu_affinity,
+	int custom_priority,
+	const Options& options)
+	: stop(false), cpu_affinity_(cpu_affinity), priority_(Priority::NORMAL),
+	custom_priority_(custom_priority), use_custom_priority_(true), options_(options)
+{
+	if (options_.numa_aware)
+		options_.scheduling = Scheduling::WORK_STEALING;
+	tasks.set_aging_limit(options_.priority_aging);
+	if (options_.scheduling == Scheduling::LOCK_FREE)
+		ring_.reset(new thread_pool_detail::MpmcQueue<Task>(options_.queue_capacity));
+	start_workers(threads);
+}
+
+inline ThreadPool::WorkerContext& ThreadPool::current_worker()
+{
+	static thread_local WorkerContext context = { nullptr, 0, false };
+	return context;
+}
+
+inline void ThreadPool::start_workers(size_t threads)
+{
+	// Busy-waiting only steals time from the producer on a single core
+	if (std::thread::hardware_concurrency() == 1)
+		options_.idle.spin_count = 0;
+
+	timer_tick_ns_ = std::max(1LL, static_cast<long long>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(options_.timer_resolution).count()));
+	timers_.reset(static_cast<unsigned long long>(thread_pool_detail::now_ns() / timer_tick_ns_));
+
+	min_threads_ = options_.min_threads > 0 ? options_.min_threads : threads;
+	max_threads_ = std::max(options_.max_threads > 0 ? options_.max_threads : threads, min_threads_);
+	auto_sizing_ = max_threads_ > min_threads_ || options_.idle_timeout.count() > 0;
+	dynamic_ = auto_sizing_;
+	threads = std::max(min_threads_, std::min(threads, max_threads_));
+
+	// Slots for every worker the pool may ever run, so stealing can scan them
+	// without synchronizing with growth
+	compensation_slots_ = options_.max_compensation > 0 ? options_.max_compensation : std::max(threads, max_threads_);
+	const size_t slots = std::max(threads, max_threads_) + compensation_slots_;
+	for (size_t i = 0; i < slots; ++i)
+		workers.emplace_back(new Worker);
+	setup_nodes();
+
+	std::lock_guard<std::mutex> lock(resize_mutex_);
+	if (options_.lazy_start)
+	{
+		lazy_threads_ = threads;
+		lazy_ = true;
+		return;
+	}
+	target_threads_ = threads;
+	spawn_workers();
+}
+
+inline void ThreadPool::setup_nodes()
+{
+	std::vector<std::vector<int>> topology;
+	if (options_.numa_aware)
+		topology = thread_pool_detail::numa_topology();
+	else
+		topology.resize(1);
+
+	for (std::vector<int>& cpus : topology)
+	{
+		nodes_.emplace_back(new NodeQueue);
+		nodes_.back()->cpus = cpus;
+	}
+
+	// A pinned worker belongs to the node of its first CPU, the others are
+	// spread round-robin
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		size_t node = i % topology.size();
+		const CpuSet cpus = worker_cpu_set(i);
+		if (!cpus.empty())
+		{
+			for (size_t n = 0; n < topology.size(); ++n)
+				if (std::find(topology[n].begin(), topology[n].end(), cpus[0]) != topology[n].end())
+					node = n;
+		}
+		workers[i]->node = node;
+	}
+
+	// Steal order: the following workers of the own node, then everybody else
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		Worker& worker = *workers[i];
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			for (size_t n = 1; n < workers.size(); ++n)
+			{
+				size_t victim = (i + n) % workers.size();
+				if ((workers[victim]->node == worker.node) == (pass == 0))
+					worker.victims.push_back(victim);
+			}
+			if (pass == 0)
+				worker.local_victims = worker.victims.size();
+		}
+	}
+}
+
+inline void ThreadPool::spawn_workers()
+{
+	const size_t target = target_threads_;
+	for (size_t i = 0; i < target; ++i)
+	{
+		Worker& worker = *workers[i];
+		if (worker.running)
+			continue;
+		if (worker.thread.joinable())
+			worker.thread.join();  // Retired earlier, already past its last lock
+		worker.running = true;
+		worker.thread.start(options_.stack_size, [this, i] { worker_loop(i); });
+	}
+}
+
+inline void ThreadPool::set_auto_sizing(bool enabled)
+{
+	dynamic_ = enabled && auto_sizing_;
+	backlog_since_.store(0, std::memory_order_relaxed);
+}
+
+inline void ThreadPool::resize(size_t threads)
+{
+	threads = std::max(size_t(1), std::min(threads, workers.size() - compensation_slots_));
+	{
+		std::lock_guard<std::mutex> lock(resize_mutex_);
+		if (stop)
+			return;
+		target_threads_ = threads + compensating_;
+		lazy_ = false;
+		spawn_workers();
+	}
+	// Let parked workers above the new target notice it
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+	}
+	condition.notify_all();
+	timer_cond_.notify_all();
+}
+
+inline void ThreadPool::maybe_grow()
+{
+	const size_t limit = max_threads_ + compensating_.load(std::memory_order_relaxed);
+	if (!dynamic_.load(std::memory_order_relaxed) || target_threads_.load(std::memory_order_relaxed) >= limit)
+		return;
+
+	// Growth needs a backlog that outlives grow_after without any worker going idle
+	const long long now = std::chrono::steady_clock::now().time_since_epoch().count();
+	long long since = backlog_since_.load(std::memory_order_relaxed);
+	if (since == 0)
+	{
+		backlog_since_.compare_exchange_strong(since, now, std::memory_order_relaxed);
+		return;
+	}
+	if (std::chrono::steady_clock::duration(now - since) < options_.grow_after)
+		return;
+
+	std::unique_lock<std::mutex> lock(resize_mutex_, std::try_to_lock);
+	if (!lock.owns_lock() || stop || target_threads_ >= max_threads_ + compensating_)
+		return;
+	target_threads_++;
+	spawn_workers();
+	backlog_since_.store(0, std::memory_order_relaxed);
+}
+
+inline void ThreadPool::start_on_demand(size_t count)
+{
+	// The first task must get a worker; after that a producer that finds the
+	// lock taken leaves the start to whoever holds it
+	std::unique_lock<std::mutex> lock(resize_mutex_, std::defer_lock);
+	if (target_threads_.load() == 0)
+		lock.lock();
+	else if (!lock.try_lock())
+		return;
+	if (stop || !lazy_)
+		return;
+	const size_t target = std::min(lazy_threads_, target_threads_ + count);
+	if (target > target_threads_)
+	{
+		target_threads_ = target;
+		spawn_workers();
+	}
+	if (target_threads_ >= lazy_threads_)
+		lazy_ = false;
+}
+
+inline void ThreadPool::warm_up()
+{
+	const WorkerContext& context = current_worker();
+	const bool inside = context.pool == this;
+	std::vector<Worker*> pending;
+	{
+		std::lock_guard<std::mutex> lock(resize_mutex_);
+		if (stop)
+			return;
+		if (lazy_)
+		{
+			target_threads_ = std::max(target_threads_.load(), lazy_threads_);
+			lazy_ = false;
+			spawn_workers();
+		}
+		for (size_t i = 0; i < target_threads_; ++i)
+		{
+			if (!workers[i]->running || (inside && i == context.index))
+				continue;
+			workers[i]->warm = true;
+			pending.push_back(workers[i].get());
+		}
+	}
+	if (inside)
+		warm_worker(context.index);
+
+	// Parked workers only wake for work: take the lock so none misses the flag
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+	}
+	condition.notify_all();
+	timer_cond_.notify_all();
+
+	std::unique_lock<std::mutex> lock(warm_mutex_);
+	for (Worker* worker : pending)
+		warm_cond_.wait(lock, [worker] { return !worker->warm; });
+}
+
+inline void ThreadPool::warm_worker(size_t index)
+{
+	const size_t limit = options_.stack_size > 0 ? options_.stack_size / 2 : options_.warm_stack;
+	thread_pool_detail::prefault_stack(std::min(options_.warm_stack, limit) / 4096);
+	thread_pool_detail::SlabArena::prime();
+	clear_warm(*workers[index]);
+}
+
+inline void ThreadPool::clear_warm(Worker& worker)
+{
+	if (!worker.warm.load(std::memory_order_acquire))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(warm_mutex_);
+		worker.warm = false;
+	}
+	warm_cond_.notify_all();
+}
+
+inline void ThreadPool::add_timer(thread_pool_detail::TimerNode* node, long long deadline_ns)
+{
+	node->tick = static_cast<unsigned long long>((deadline_ns + timer_tick_ns_ - 1) / timer_tick_ns_);
+	long long previous, next;
+	{
+		std::lock_guard<std::mutex> lock(timer_mutex_);
+		timers_.insert(node);
+		previous = next_timer_ns_.load(std::memory_order_relaxed);
+		next = timer_wake_ns(timers_.next_tick());
+		next_timer_ns_.store(next, std::memory_order_relaxed);
+	}
+	if (next >= previous)
+		return;
+
+	// A lazy pool may have no worker to keep the timers yet
+	if (lazy_.load(std::memory_order_relaxed) && target_threads_.load() == 0)
+		start_on_demand(1);
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	if (timer_keeper_)
+		timer_cond_.notify_one();
+	else
+		condition.notify_one();  // A parked worker, if any, becomes the keeper
+}
+
+inline void ThreadPool::run_timers()
+{
+	std::vector<thread_pool_detail::TimerNode*> due;
+	std::vector<Task> batch;
+	// Firing workers do not queue up behind each other
+	std::unique_lock<std::mutex> lock(timer_mutex_, std::try_to_lock);
+	if (!lock.owns_lock() || stop)
+		return;
+
+	const unsigned long long tick = static_cast<unsigned long long>(thread_pool_detail::now_ns() / timer_tick_ns_);
+	timers_.expire(tick, due);
+	for (thread_pool_detail::TimerNode* node : due)
+	{
+		if (!node->periodic)
+		{
+			batch.push_back(std::move(node->task));
+			delete node;
+			continue;
+		}
+		thread_pool_detail::PeriodicTimer& timer = *node->periodic;
+		if (timer.cancel->cancelled.load(std::memory_order_acquire))
+		{
+			delete node;
+			continue;
+		}
+		if (!timer.running.exchange(true, std::memory_order_acq_rel))
+		{
+			thread_pool_detail::PeriodicRun run = { node->periodic };
+			batch.emplace_back(std::move(run));
+		}
+		// Fixed rate: the first tick of the original grid after this one
+		node->tick += ((tick - node->tick) / timer.period + 1) * timer.period;
+		timers_.insert(node);
+	}
+	next_timer_ns_.store(timer_wake_ns(timers_.next_tick()), std::memory_order_relaxed);
+
+	// Still under timer_mutex_, which keeps the destructor from setting stop meanwhile
+	push_tasks(batch);
+}
+
+inline bool ThreadPool::timers_due() const
+{
+	const long long next = next_timer_ns_.load(std::memory_order_relaxed);
+	return next != LLONG_MAX && thread_pool_detail::now_ns() >= next;
+}
+
+inline long long ThreadPool::timer_wake_ns(unsigned long long tick) const
+{
+	if (tick == thread_pool_detail::TimerWheel::none
+		|| tick >= static_cast<unsigned long long>(LLONG_MAX / timer_tick_ns_))
+		return LLONG_MAX;
+	return static_cast<long long>(tick) * timer_tick_ns_;
+}
+
+template<class Rep, class Period>
+long long ThreadPool::timer_deadline(std::chrono::duration<Rep, Period> delay)
+{
+	const long long now = thread_pool_detail::now_ns();
+	const double ns = std::chrono::duration<double, std::nano>(delay).count();
+	if (!(ns > 0))
+		return now;
+	// About 146 years out: far enough to never fire, short of overflowing
+	const long long limit = LLONG_MAX / 2;
+	return ns >= static_cast<double>(limit - now) ? limit : now + static_cast<long long>(ns);
+}
+
+inline void ThreadPool::shrink_idle()
+{
+	if (!dynamic_.load(std::memory_order_relaxed))
+		return;
+	size_t target = target_threads_.load();
+	while (target > min_threads_ + compensating_.load() && !target_threads_.compare_exchange_weak(target, target - 1))
+	{
+	}
+}
+
+inline bool ThreadPool::begin_blocking()
+{
+	// A lazy pool still has workers to start instead
+	if (lazy_.load())
+	{
+		start_on_demand(1);
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(resize_mutex_);
+	if (stop || compensating_ >= compensation_slots_ || target_threads_ >= workers.size())
+		return false;
+	compensating_++;
+	target_threads_++;
+	spawn_workers();
+	return true;
+}
+
+inline void ThreadPool::end_blocking()
+{
+	{
+		std::lock_guard<std::mutex> lock(resize_mutex_);
+		compensating_--;
+		if (target_threads_ > 1)
+			target_threads_--;
+	}
+	// The highest slot leaves; if it is parked, wake it
+	if (sleepers_.load() > 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(queue_mutex);
+		}
+		condition.notify_all();
+		timer_cond_.notify_all();
+	}
+}
+
+inline ThreadPool::BlockingScope::BlockingScope(ThreadPool& pool)
+	: pool_(nullptr)
+{
+	WorkerContext& context = current_worker();
+	if (context.pool != &pool || context.blocking || !pool.begin_blocking())
+		return;
+	context.blocking = true;
+	pool_ = &pool;
+}
+
+inline ThreadPool::BlockingScope::~BlockingScope()
+{
+	if (!pool_)
+		return;
+	current_worker().blocking = false;
+	pool_->end_blocking();
+}
+
+inline bool ThreadPool::try_retire(size_t index)
+{
+	// Decided under resize_mutex_ so a concurrent grow either sees the slot free
+	// or keeps this worker
+	std::lock_guard<std::mutex> lock(resize_mutex_);
+	if (index < target_threads_ || stop)
+		return false;
+	workers[index]->running = false;
+	clear_warm(*workers[index]);
+	return true;
+}
+
+inline void ThreadPool::worker_loop(size_t index)
+{
+	// The spawner assigns workers[index]->thread under resize_mutex_: wait for
+	// it before using the handle below
+	{
+		std::lock_guard<std::mutex> lock(resize_mutex_);
+	}
+
+	// Set CPU affinity (if configured)
+	const CpuSet cpus = worker_cpu_set(index);
+	if (!cpus.empty())
+		set_thread_affinity(workers[index]->thread, cpus);
+	else if (options_.numa_aware)
+		set_thread_affinity(workers[index]->thread, nodes_[workers[index]->node]->cpus);
+
+	// Set thread priority
+	if (use_custom_priority_)
+		set_thread_priority(workers[index]->thread, custom_priority_);
+	else
+		set_thread_priority(workers[index]->thread, priority_);
+
+	WorkerContext& context = current_worker();
+	context.pool = this;
+	context.index = index;
+#if defined(THREAD_POOL_METRICS)
+	thread_pool_detail::WorkerMetrics& metrics = workers[index]->metrics;
+	metrics.started_ns.store(thread_pool_detail::now_ns(), std::memory_order_relaxed);
+	metrics.busy_ns.store(0, std::memory_order_relaxed);
+#endif
+
+	for (;;)
+	{
+		// Above the target after resize() or a BlockingScope: leave between
+		// tasks, handing queued work to a parked worker
+		if (index >= target_threads_.load(std::memory_order_relaxed) && try_retire(index))
+		{
+			if (has_work())
+				wake_workers(1);
+			return;
+		}
+		if (workers[index]->warm.load(std::memory_order_acquire))
+			warm_worker(index);
+		if (timers_due())
+			run_timers();
+
+		Task task;
+		if (!try_get_task(index, task))
+		{
+			if (!wait_for_work(index))
+				return;
+			continue;
+		}
+		run_task(task);  // Execute task
+	}
+}
+
+inline bool ThreadPool::try_get_task(size_t index, Task& task)
+{
+	if (options_.scheduling == Scheduling::SHARED_QUEUE && options_.dequeue_batch > 1)
+	{
+		// HIGH/CRITICAL tasks, then the own batch, else a new batch, else steal
+		// from another worker's batch. Batches only hold NORMAL and LOW tasks,
+		// so an urgent task never waits behind one.
+		Worker& worker = *workers[index];
+		if (pop_injected(task, true))
+			return true;
+		if (worker.size.load(std::memory_order_relaxed) == 0 && pop_shared_batch(worker, task))
+			return true;
+		return queued_.load(std::memory_order_relaxed) > 0 && pop_task(index, task);
+	}
+	if (options_.scheduling == Scheduling::SHARED_QUEUE)
+	{
+		if (tasks_size_.load(std::memory_order_relaxed) == 0)
+			return false;
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (!tasks.try_pop(task))
+			return false;
+		tasks_size_--;
+		count_urgent();
+		return true;
+	}
+
+	// HIGH/CRITICAL injected tasks go before the regular source, LOW ones after it
+	// (or first, once every priority_aging pops, so they cannot starve). The
+	// queue lock is only taken when the level looked for is non-empty.
+	Worker& worker = *workers[index];
+	worker.pops++;
+	const bool aged = options_.priority_aging > 0 && worker.pops % options_.priority_aging == 0;
+	if (pop_injected(task, !aged))
+		return true;
+	bool found = options_.scheduling == Scheduling::WORK_STEALING
+		? pop_task(index, task) : ring_->try_pop(task);
+	return found || pop_injected(task, false);
+}
+
+inline bool ThreadPool::pop_shared_batch(Worker& worker, Task& task)
+{
+	if (tasks_size_.load(std::memory_order_relaxed) == 0)
+		return false;
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	if (!tasks.try_pop(task))
+		return false;
+	// No batch while urgent tasks are queued: they are taken one at a time
+	const size_t high = static_cast<size_t>(TaskPriority::HIGH);
+	const size_t count = tasks.size_from(high) > 0 ? 1 : dequeue_batch_size(tasks.size() + 1);
+	if (count > 1)
+	{
+		// Oldest at the back: the owner keeps queue order, thieves take the newest
+		std::lock_guard<std::mutex> worker_lock(worker.mutex);
+		Task next;
+		size_t moved = 0;
+		while (moved + 1 < count && tasks.try_pop(next))
+		{
+			worker.tasks.push_front(std::move(next));
+			++moved;
+		}
+		queued_ += moved;
+		worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+		tasks_size_ -= moved;
+	}
+	tasks_size_--;
+	count_urgent();
+	return true;
+}
+
+inline size_t ThreadPool::dequeue_batch_size(size_t depth) const
+{
+	// Fair share of the backlog, so one worker cannot hoard it while others idle
+	const size_t threads = std::max<size_t>(1, target_threads_.load(std::memory_order_relaxed));
+	return std::max<size_t>(1, std::min(options_.dequeue_batch, depth / threads));
+}
+
+inline bool ThreadPool::pop_injected(Task& task, bool urgent_only)
+{
+	if ((urgent_only ? urgent_size_ : tasks_size_).load(std::memory_order_relaxed) == 0)
+		return false;
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	size_t min_level = urgent_only ? static_cast<size_t>(TaskPriority::HIGH) : 0;
+	if (!tasks.try_pop(task, min_level))
+		return false;
+	tasks_size_--;
+	count_urgent();
+	return true;
+}
+
+inline void ThreadPool::count_urgent()
+{
+	urgent_size_.store(tasks.size_from(static_cast<size_t>(TaskPriority::HIGH)), std::memory_order_relaxed);
+}
+
+inline bool ThreadPool::has_work() const
+{
+	return tasks_size_ > 0 || queued_ > 0 || node_queued_ > 0 || (ring_ && ring_->has_items());
+}
+
+inline bool ThreadPool::wait_for_work(size_t index)
+{
+	// A worker going idle ends any backlog that could justify growing
+	if (dynamic_.load(std::memory_order_relaxed) && backlog_since_.load(std::memory_order_relaxed) != 0)
+		backlog_since_.store(0, std::memory_order_relaxed);
+
+	// Spin, then yield, before parking: a task posted meanwhile starts without a
+	// futex wake, and producers skip notify_one while somebody is spinning
+	const IdlePolicy& idle = options_.idle;
+	const unsigned rounds = idle.spin_count + idle.yield_count;
+	if (rounds > 0)
+	{
+		spinning_++;
+		for (unsigned i = 0; i < rounds && !stop; ++i)
+		{
+			if (has_work())
+			{
+				// The last spinner leaving hands over to a parked worker, since
+				// producers did not wake anyone while it was spinning
+				if (spinning_.fetch_sub(1) == 1)
+					wake_workers(1);
+				return true;
+			}
+			if (i < idle.spin_count)
+				thread_pool_detail::cpu_relax();
+			else
+				std::this_thread::yield();
+		}
+		spinning_--;
+	}
+
+	std::atomic<unsigned>& pins = workers[index]->trace_pins;
+	if (const TraceHooks* hooks = pin_trace_hooks(pins))
+	{
+		if (hooks->on_idle)
+			hooks->on_idle(trace_event(nullptr));
+		unpin_trace_hooks(pins);
+	}
+
+	// Park until a producer publishes work. has_work() is re-checked under the lock
+	// after announcing the sleeper; producers publish before reading sleepers_ and
+	// take the lock before notifying, so wakeups cannot be lost.
+	std::unique_lock<std::mutex> lock(this->queue_mutex);
+	sleepers_++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	// Pending timers need a keeper: the first worker to park takes the role
+	auto keeper_wanted = [this]
+	{
+		return !timer_keeper_ && next_timer_ns_.load(std::memory_order_relaxed) != LLONG_MAX;
+	};
+	auto ready = [this, index, &keeper_wanted]
+	{
+		return this->stop || has_work() || index >= target_threads_ || workers[index]->warm || keeper_wanted();
+	};
+	if (keeper_wanted())
+	{
+		// Sleep until the next timer is due; add_timer() wakes us for an
+		// earlier one, producers when work arrives
+		timer_keeper_ = true;
+		while (!ready())
+		{
+			const long long next = next_timer_ns_.load(std::memory_order_relaxed);
+			if (next == LLONG_MAX || thread_pool_detail::now_ns() >= next)
+				break;
+			timer_cond_.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next)));
+		}
+		timer_keeper_ = false;
+		// Leaving for work or to retire: another parked worker takes over the
+		// timers. Leaving to fire them, this worker is back as keeper after.
+		if ((has_work() || index >= target_threads_) && sleepers_ > 1
+			&& next_timer_ns_.load(std::memory_order_relaxed) != LLONG_MAX)
+			this->condition.notify_one();
+	}
+	else if (options_.idle_timeout.count() > 0)
+	{
+		while (!ready())
+		{
+			if (this->condition.wait_for(lock, options_.idle_timeout) == std::cv_status::timeout
+				&& !ready())
+			{
+				// Idle for a whole timeout: one worker fewer is enough. The highest
+				// slot leaves, wake it in case that is somebody else.
+				shrink_idle();
+				this->condition.notify_all();
+			}
+		}
+	}
+	else
+	{
+		this->condition.wait(lock, ready);
+	}
+	sleepers_--;
+	lock.unlock();
+
+	if (const TraceHooks* hooks = pin_trace_hooks(pins))  // May have changed while parked
+	{
+		if (hooks->on_wake)
+			hooks->on_wake(trace_event(nullptr));
+		unpin_trace_hooks(pins);
+	}
+
+	if (index >= target_threads_ && !has_work() && try_retire(index))
+		return false;
+	return !(this->stop && !has_work());
+}
+
+inline void ThreadPool::run_task(Task& task)
+{
+	const thread_pool_detail::TaskGuard* guard = task.guard();
+	if (guard && discard_task(task, *guard))
+		return;
+#if defined(THREAD_POOL_METRICS)
+	// Only workers record (a histogram has a single writer)
+	const WorkerContext& context = current_worker();
+	thread_pool_detail::WorkerMetrics* metrics = context.pool == this ? &workers[context.index]->metrics : nullptr;
+	const long long start = thread_pool_detail::now_ns();
+	if (metrics)
+		metrics->queue_wait.record(static_cast<unsigned long long>(std::max(0LL, start - task.created_at())));
+#endif
+	std::atomic<unsigned>& pins = trace_pins();
+	const TraceHooks* hooks = pin_trace_hooks(pins);
+	const char* tag = nullptr;
+	if (hooks)
+	{
+		tag = task.tag();
+		if (hooks->on_task_begin)
+			hooks->on_task_begin(trace_event(tag));
+	}
+	try
+	{
+		task();
+	}
+	catch (...)
+	{
+		// Only posted tasks get here, enqueue() stores exceptions in the future
+		handle_exception(std::current_exception());
+	}
+	task.reset();
+	if (hooks)
+	{
+		if (hooks->on_task_end)
+			hooks->on_task_end(trace_event(tag));
+		unpin_trace_hooks(pins);
+	}
+#if defined(THREAD_POOL_METRICS)
+	if (metrics)
+	{
+		const unsigned long long elapsed = static_cast<unsigned long long>(thread_pool_detail::now_ns() - start);
+		metrics->run_time.record(elapsed);
+		metrics->add(metrics->busy_ns, elapsed);
+		metrics->add(metrics->tasks, 1);
+	}
+#endif
+	finish_tasks(1);
+}
+
+template<class Fn>
+ThreadPool::Task ThreadPool::make_task(const TaskOptions& options, Fn&& fn)
+{
+	const bool timed = options.deadline != std::chrono::steady_clock::time_point::max();
+	const bool droppable = options_.max_pending > 0 && options_.overflow == OverflowPolicy::DROP_OLDEST;
+	if (!options.tag && !options.cancel && !timed && !droppable)
+		return Task(std::forward<Fn>(fn));
+
+	long long deadline_ns = 0;
+	if (timed)
+	{
+		deadline_ns = std::max(1LL, static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			options.deadline.time_since_epoch()).count()));
+	}
+	thread_pool_detail::GuardedTask<typename std::decay<Fn>::type> guarded = {
+		{ options.tag, options.cancel.state_, deadline_ns, cancel_epoch_.load(std::memory_order_acquire), droppable },
+		std::forward<Fn>(fn) };
+	return Task(std::move(guarded));
+}
+
+inline bool ThreadPool::discard_task(Task& task, const thread_pool_detail::TaskGuard& guard)
+{
+	TaskCancelled::Reason reason;
+	if (guard.cancel && guard.cancel->cancelled.load(std::memory_order_acquire))
+		reason = TaskCancelled::Reason::CANCELLED;
+	else if (guard.deadline_ns != 0 && thread_pool_detail::now_ns() > guard.deadline_ns)
+		reason = TaskCancelled::Reason::EXPIRED;
+	else if (guard.tag && guard.epoch < cancel_epoch_.load(std::memory_order_acquire)
+		&& tag_cancelled(guard.tag, guard.epoch))
+		reason = TaskCancelled::Reason::TAG;
+	else
+		return false;
+
+	task.cancel(std::make_exception_ptr(TaskCancelled(reason)));
+	tasks_cancelled_++;
+	finish_tasks(1);
+	return true;
+}
+
+inline bool ThreadPool::tag_cancelled(const char* tag, unsigned long long epoch)
+{
+	std::lock_guard<std::mutex> lock(cancel_mutex_);
+	for (const std::pair<std::string, unsigned long long>& entry : cancelled_tags_)
+		if (entry.first == tag)
+			return entry.second > epoch;
+	return false;
+}
+
+inline void ThreadPool::cancel_tag(const char* tag)
+{
+	std::lock_guard<std::mutex> lock(cancel_mutex_);
+	const unsigned long long epoch = cancel_epoch_.load(std::memory_order_relaxed) + 1;
+	bool found = false;
+	for (std::pair<std::string, unsigned long long>& entry : cancelled_tags_)
+	{
+		if (entry.first == tag)
+		{
+			entry.second = epoch;
+			found = true;
+		}
+	}
+	if (!found)
+		cancelled_tags_.push_back(std::make_pair(std::string(tag), epoch));
+	cancel_epoch_.store(epoch, std::memory_order_release);
+}
+
+inline void ThreadPool::finish_tasks(size_t count)
+{
+	// Notify only when somebody waits and the count reached what it waits for:
+	// zero, or the tasks held up by drain_and_help() callers. Together with the
+	// increment-then-check in drain() (both seq_cst) one side always sees the
+	// other; taking drain_mutex_ guarantees the drainer is either before its
+	// check or already waiting.
+	const size_t left = task_count_.fetch_sub(count) - count;
+	if (drain_waiters_.load() > 0 && left <= blocked_tasks_.load())
+	{
+		std::lock_guard<std::mutex> lock(drain_mutex_);
+		task_done_cond_.notify_all();  // Notify drain() of task completion
+	}
+
+	// Same pairing for producers waiting for room below max_pending
+	if (options_.max_pending > 0 && left < options_.max_pending && space_waiters_.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(space_mutex_);
+		space_cond_.notify_all();
+	}
+	if (options_.high_watermark > 0 && left <= options_.low_watermark && above_watermark_.load())
+		signal_watermark(false);
+}
+
+inline bool ThreadPool::admit(size_t count)
+{
+	if (options_.high_watermark > 0 && !above_watermark_.load(std::memory_order_relaxed)
+		&& task_count_.load(std::memory_order_relaxed) + count >= options_.high_watermark)
+		signal_watermark(true);
+
+	const size_t limit = options_.max_pending;
+	if (limit == 0 || task_count_.load(std::memory_order_relaxed) + count <= limit)
+		return true;
+
+	switch (options_.overflow)
+	{
+	case OverflowPolicy::REJECT:
+		throw QueueFull();
+	case OverflowPolicy::CALLER_RUNS:
+		return false;
+	case OverflowPolicy::DROP_OLDEST:
+	{
+		// Admitted even if not enough could be shed (tasks running or not
+		// droppable). The lock-free ring cannot be searched, so in LOCK_FREE
+		// mode a shortfall waits for space as with BLOCK.
+		const size_t excess = task_count_.load() + count - limit;
+		if (drop_oldest(excess) >= excess || !ring_)
+			return true;
+		break;
+	}
+	default:
+		break;
+	}
+	if (!wait_for_space(count))
+		throw QueueFull();
+	return true;
+}
+
+inline void ThreadPool::run_inline(Task& task)
+{
+	task_count_++;  // run_task() accounts for it as for a queued task
+	run_task(task);
+}
+
+inline bool ThreadPool::wait_for_space(size_t count)
+{
+	// A batch larger than the limit goes in once the pool is empty
+	const size_t limit = options_.max_pending;
+	auto fits = [this, count, limit]
+	{
+		const size_t pending = task_count_.load();
+		return pending == 0 || pending + count <= limit;
+	};
+	// Inside a task: the pending count includes the task (and whatever it
+	// waits on), waiting could deadlock once all workers do it
+	if (tasks_on_stack() > 0)
+		return true;
+
+	const bool timed = options_.block_timeout.count() > 0;
+	const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + options_.block_timeout;
+	std::unique_lock<std::mutex> lock(space_mutex_);
+	space_waiters_++;
+	bool room = true;
+	if (timed)
+		room = space_cond_.wait_until(lock, deadline, fits);
+	else
+		space_cond_.wait(lock, fits);
+	space_waiters_--;
+	return room;
+}
+
+inline bool ThreadPool::is_droppable(const Task& task)
+{
+	const thread_pool_detail::TaskGuard* guard = task.guard();
+	return guard && guard->droppable;
+}
+
+inline size_t ThreadPool::drop_oldest(size_t count)
+{
+	size_t dropped = 0;
+	Task task;
+	while (dropped < count && take_droppable(task))
+	{
+		task.cancel(std::make_exception_ptr(TaskCancelled(TaskCancelled::Reason::DROPPED)));
+		tasks_cancelled_++;
+		finish_tasks(1);
+		++dropped;
+	}
+	return dropped;
+}
+
+inline bool ThreadPool::take_droppable(Task& task)
+{
+	// Queues are searched from their oldest end. The LOCK_FREE ring is not
+	// searched: it only gives up its head, which may be a task that must not
+	// be shed and cannot be put back in its place.
+	if (tasks_size_.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (tasks.remove_first(task, &ThreadPool::is_droppable))
+		{
+			tasks_size_--;
+			count_urgent();
+			return true;
+		}
+	}
+	for (size_t n = 0; n < nodes_.size() && node_queued_.load(std::memory_order_relaxed) > 0; ++n)
+	{
+		NodeQueue& queue = *nodes_[n];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		std::deque<Task>::iterator it = std::find_if(queue.tasks.begin(), queue.tasks.end(), &ThreadPool::is_droppable);
+		if (it != queue.tasks.end())
+		{
+			task = std::move(*it);
+			queue.tasks.erase(it);
+			queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+			node_queued_--;
+			return true;
+		}
+	}
+	for (size_t i = 0; i < workers.size() && queued_.load(std::memory_order_relaxed) > 0; ++i)
+	{
+		Worker& worker = *workers[i];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		std::deque<Task>::iterator it = std::find_if(worker.tasks.begin(), worker.tasks.end(), &ThreadPool::is_droppable);
+		if (it != worker.tasks.end())
+		{
+			task = std::move(*it);
+			worker.tasks.erase(it);
+			worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+			queued_--;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline void ThreadPool::signal_watermark(bool above)
+{
+	std::lock_guard<std::mutex> lock(watermark_mutex_);
+	if (above_watermark_.exchange(above) == above)
+		return;
+	// The flag is published before the count is read (finish_tasks() does the
+	// reverse), so a crossing back that happened meanwhile is seen here
+	const size_t pending = task_count_.load();
+	if (above ? pending <= options_.low_watermark : pending > options_.low_watermark)
+	{
+		above_watermark_.store(!above);
+		return;
+	}
+	if (options_.on_watermark)
+		options_.on_watermark(above);
+}
+
+inline void ThreadPool::push_task(Task&& task)
+{
+	push_task(std::move(task), TaskOptions());
+}
+
+inline void ThreadPool::push_task(Task&& task, const TaskOptions& options)
+{
+	const TaskPriority priority = options.priority;
+	if (options_.scheduling == Scheduling::SHARED_QUEUE || priority != TaskPriority::NORMAL)
+	{
+		// Shared queue, or a prioritized task outside shared queue mode
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+
+			if (stop)
+				throw std::runtime_error("enqueue on stopped ThreadPool");
+
+			tasks.push(std::move(task), static_cast<size_t>(priority));
+			tasks_size_++;
+			if (priority >= TaskPriority::HIGH)
+				urgent_size_++;
+			task_count_++;  // Increase counter when enqueuing
+		}
+		wake_workers(1);
+		return;
+	}
+
+	if (stop)
+		throw std::runtime_error("enqueue on stopped ThreadPool");
+
+	task_count_++;  // Increase counter when enqueuing
+	if (options_.scheduling == Scheduling::LOCK_FREE)
+	{
+		while (!ring_->try_push(std::move(task)))
+		{
+			// Queue full: a worker helps by running a task instead of waiting on itself
+			Task other;
+			if (is_worker_thread() && ring_->try_pop(other))
+				run_task(other);
+			else
+				std::this_thread::yield();
+		}
+		wake_workers(1);
+		return;
+	}
+
+	// Workers push to their own deque, external threads spread round-robin
+	WorkerContext& context = current_worker();
+	const bool local = context.pool == this;
+	if (options_.numa_aware && (!local || (options.node >= 0
+		&& static_cast<size_t>(options.node) % nodes_.size() != workers[context.index]->node)))
+	{
+		// Off-node or external submission: the node queue, taken by that node's workers first
+		size_t node = options.node >= 0 ? static_cast<size_t>(options.node)
+			: next_node_.fetch_add(1, std::memory_order_relaxed);
+		NodeQueue& queue = *nodes_[node % nodes_.size()];
+		node_queued_++;
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(task));
+			queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+		}
+		wake_workers(1);
+		return;
+	}
+
+	size_t target = local ? context.index
+		: next_victim_.fetch_add(1, std::memory_order_relaxed) % std::max<size_t>(1, target_threads_);
+	Worker& worker = *workers[target];
+
+	queued_++;
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+		worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+	}
+	wake_workers(1);
+}
+
+inline bool ThreadPool::try_push_task(Task&& task)
+{
+	if (options_.scheduling != Scheduling::LOCK_FREE)
+	{
+		push_task(std::move(task));
+		return true;
+	}
+
+	if (stop)
+		throw std::runtime_error("enqueue on stopped ThreadPool");
+
+	task_count_++;
+	if (!ring_->try_push(std::move(task)))
+	{
+		finish_tasks(1);
+		return false;
+	}
+	wake_workers(1);
+	return true;
+}
+
+inline void ThreadPool::push_tasks(std::vector<Task>& batch)
+{
+	const size_t count = batch.size();
+	if (count == 0)
+		return;
+
+	if (options_.scheduling == Scheduling::LOCK_FREE)
+	{
+		// No lock to amortize: publish one by one, waking as push_task would
+		for (Task& task : batch)
+			push_task(std::move(task));
+		return;
+	}
+
+	if (options_.scheduling == Scheduling::WORK_STEALING)
+	{
+		if (stop)
+			throw std::runtime_error("enqueue on stopped ThreadPool");
+
+		// A worker keeps the batch local (idle workers steal from it),
+		// an external thread splits it evenly across the worker deques
+		WorkerContext& context = current_worker();
+		const bool local = context.pool == this;
+		if (options_.numa_aware && !local)
+		{
+			// Spread external batches over the node queues
+			task_count_ += count;
+			node_queued_ += count;
+			const size_t parts = std::min(count, nodes_.size());
+			const size_t first = next_node_.fetch_add(parts, std::memory_order_relaxed);
+			size_t begin = 0;
+			for (size_t part = 0; part < parts; ++part)
+			{
+				size_t end = begin + (count - begin) / (parts - part);
+				NodeQueue& queue = *nodes_[(first + part) % nodes_.size()];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				for (size_t i = begin; i < end; ++i)
+					queue.tasks.push_back(std::move(batch[i]));
+				queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+				begin = end;
+			}
+			wake_workers(count);
+			return;
+		}
+		const size_t threads = std::max<size_t>(1, target_threads_);  // 0 before a lazy start
+		const size_t parts = local ? 1 : std::min(count, threads);
+		const size_t first = local ? context.index
+			: next_victim_.fetch_add(parts, std::memory_order_relaxed);
+
+		task_count_ += count;
+		queued_ += count;
+		size_t begin = 0;
+		for (size_t part = 0; part < parts; ++part)
+		{
+			size_t end = begin + (count - begin) / (parts - part);
+			Worker& worker = *workers[(first + part) % threads];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			for (size_t i = begin; i < end; ++i)
+				worker.tasks.push_back(std::move(batch[i]));
+			worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+			begin = end;
+		}
+		wake_workers(count);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		if (stop)
+			throw std::runtime_error("enqueue on stopped ThreadPool");
+
+		for (Task& task : batch)
+			tasks.push(std::move(task), static_cast<size_t>(TaskPriority::NORMAL));
+		tasks_size_ += count;
+		task_count_ += count;
+	}
+	wake_workers(count);
+}
+
+inline void ThreadPool::wake_workers(size_t count)
+{
+	// Pairs with the fence in wait_for_work(): either the parking worker sees the
+	// published task or we see it in sleepers_
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	// Spinning workers pick up published tasks by themselves
+	size_t spinning = spinning_.load(std::memory_order_relaxed);
+	if (spinning >= count)
+		return;
+	count -= spinning;
+
+	size_t sleepers = sleepers_.load(std::memory_order_relaxed);
+	if (sleepers == 0)
+	{
+		// Nobody idle to take the work: start a lazy worker or maybe grow
+		if (lazy_.load(std::memory_order_relaxed))
+			start_on_demand(count);
+		else if (spinning == 0)
+			maybe_grow();
+		return;
+	}
+
+	// Outside shared queue mode tasks are published without queue_mutex: taking it
+	// once makes sure a worker that saw no work is already waiting on condition
+	if (options_.scheduling != Scheduling::SHARED_QUEUE)
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+	}
+
+	// Waking more workers than there are tasks only produces spurious wakeups.
+	// The timer keeper waits apart and is only needed when all are woken.
+	if (count >= sleepers)
+	{
+		condition.notify_all();
+		timer_cond_.notify_all();
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		condition.notify_one();
+}
+
+// Work-stealing: the owner takes the newest task (LIFO keeps caches warm). Then,
+// nearest first: the own node queue, workers of the own node, other node queues,
+// workers of other nodes. Without numa_aware there is a single node.
+inline bool ThreadPool::pop_task(size_t index, Task& task)
+{
+	Worker& worker = *workers[index];
+	if (worker.size.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (!worker.tasks.empty())
+		{
+			task = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+			worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+			queued_--;
+			return true;
+		}
+	}
+
+	const bool numa = options_.numa_aware && node_queued_.load(std::memory_order_relaxed) > 0;
+	if (numa && pop_node(worker.node, task, options_.dequeue_batch > 1 ? &worker : nullptr))
+		return true;
+	for (size_t n = 0; n < worker.local_victims; ++n)
+		if (steal_task(*workers[worker.victims[n]], task))
+		{
+#if defined(THREAD_POOL_METRICS)
+			worker.metrics.add(worker.metrics.steals, 1);
 #endif
+			return true;
+		}
+	if (numa)
+	{
+		for (size_t n = 1; n < nodes_.size(); ++n)
+			if (pop_node((worker.node + n) % nodes_.size(), task))
+				return true;
+	}
+	for (size_t n = worker.local_victims; n < worker.victims.size(); ++n)
+		if (steal_task(*workers[worker.victims[n]], task))
+		{
+#if defined(THREAD_POOL_METRICS)
+			worker.metrics.add(worker.metrics.steals, 1);
+#endif
+			return true;
+		}
+	return false;
+}
 
-class ThreadPool
+inline bool ThreadPool::pop_node(size_t node, Task& task, Worker* worker)
 {
-public:
-	// Thread priority enumeration
-	enum class Priority
+	NodeQueue& queue = *nodes_[node];
+	if (queue.size.load(std::memory_order_relaxed) == 0)
+		return false;
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+	task = std::move(queue.tasks.front());
+	queue.tasks.pop_front();
+	size_t taken = 1;
+	const size_t count = worker ? dequeue_batch_size(queue.tasks.size() + 1) : 1;
+	if (count > 1)
 	{
-		LOW,
-		NORMAL,
-		HIGH,
-		REALTIME
-	};
+		// Workers of the node (and then everybody) steal the batch from the deque
+		std::lock_guard<std::mutex> worker_lock(worker->mutex);
+		for (; taken < count && !queue.tasks.empty(); ++taken)
+		{
+			worker->tasks.push_front(std::move(queue.tasks.front()));
+			queue.tasks.pop_front();
+		}
+		queued_ += taken - 1;
+		worker->size.store(worker->tasks.size(), std::memory_order_relaxed);
+	}
+	queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+	node_queued_ -= taken;
+	return true;
+}
 
-	// Constructor with optional parameters: CPU affinity and priority
-	ThreadPool(size_t threads,
-		const std::vector<int>& cpu_affinity = {},
-		Priority priority = Priority::NORMAL);
+// Work-stealing: thieves take the oldest task from the other end of a victim's deque
+inline bool ThreadPool::steal_task(Worker& victim, Task& task)
+{
+	if (victim.size.load(std::memory_order_relaxed) == 0)
+		return false;
+	std::lock_guard<std::mutex> lock(victim.mutex);
+	if (victim.tasks.empty())
+		return false;
+	task = std::move(victim.tasks.front());
+	victim.tasks.pop_front();
+	victim.size.store(victim.tasks.size(), std::memory_order_relaxed);
+	queued_--;
+	return true;
+}
 
-	// Constructor with numerical priority
-	ThreadPool(size_t threads,
-		const std::vector<int>& cpu_affinity,
-		int custom_priority);
+// Wait for all tasks to complete (drain)
+inline void ThreadPool::drain()
+{
+	if (task_count_ == 0)
+		return;
 
-	template<class F, class... Args>
-	auto enqueue(F&& f, Args&&... args)
-		-> std::future<typename std::result_of<F(Args...)>::type>;
+	std::unique_lock<std::mutex> lock(drain_mutex_);
+	drain_waiters_++;
+	// Wait for task counter to reach zero (efficient waiting via condition variable)
+	task_done_cond_.wait(lock, [this] { return task_count_ == 0; });
+	drain_waiters_--;
+}
 
-	~ThreadPool();
+inline void ThreadPool::drain_and_help()
+{
+	const size_t own = tasks_on_stack();
+	if (own > 0)
+	{
+		// Waiters may be waiting for exactly the tasks this thread now holds up
+		blocked_tasks_ += own;
+		std::lock_guard<std::mutex> lock(drain_mutex_);
+		task_done_cond_.notify_all();
+	}
 
-	// Wait for all tasks to complete (drain)
-	void drain();
+	while (task_count_.load() > blocked_tasks_.load())
+	{
+		if (help_one())
+			continue;
 
-private:
-	// Set thread CPU affinity function
-	void set_thread_affinity(std::thread& thread, int cpu_core);
+		// Nothing queued: wait for completions, looking for new work now and then
+		std::unique_lock<std::mutex> lock(drain_mutex_);
+		drain_waiters_++;
+		task_done_cond_.wait_for(lock, std::chrono::milliseconds(1),
+			[this] { return task_count_.load() <= blocked_tasks_.load() || has_work(); });
+		drain_waiters_--;
+	}
+	blocked_tasks_ -= own;
+}
 
-	// Set thread priority function (enumeration version)
-	void set_thread_priority(std::thread& thread, Priority priority);
+template<class Future>
+void ThreadPool::wait(const Future& future)
+{
+	for (;;)
+	{
+		const std::future_status status = future.wait_for(std::chrono::seconds(0));
+		if (status == std::future_status::ready)
+			return;
+		if (status == std::future_status::deferred)
+		{
+			future.wait();  // Runs on this thread anyway
+			return;
+		}
+		if (!help_one())
+			future.wait_for(std::chrono::microseconds(100));  // Nothing to run: back off
+	}
+}
 
-	// Set thread priority function (numerical version)
-	void set_thread_priority(std::thread& thread, int custom_priority);
+inline ThreadPool::HelpFrame*& ThreadPool::help_frames()
+{
+	static thread_local HelpFrame* frames = nullptr;
+	return frames;
+}
 
-	// Thread collection (for joining)
-	std::vector<std::thread> workers;
-	// Task queue
-	std::queue<std::function<void()>> tasks;
+inline bool ThreadPool::help_one()
+{
+	Task task;
+	const WorkerContext& context = current_worker();
+	if (!(context.pool == this ? try_get_task(context.index, task) : try_get_external(task)))
+		return false;
 
-	// Synchronization primitives
-	std::mutex queue_mutex;
-	std::condition_variable condition;
-	bool stop;
+	HelpFrame frame = { this, help_frames() };
+	help_frames() = &frame;
+	try
+	{
+		run_task(task);
+	}
+	catch (...)
+	{
+		help_frames() = frame.next;
+		throw;
+	}
+	help_frames() = frame.next;
+	return true;
+}
 
-	// Stored configurations
-	std::vector<int> cpu_affinity_;
-	Priority priority_;
+inline bool ThreadPool::try_get_external(Task& task)
+{
+	// Any queue in any mode, oldest work first; deques are stolen from like a worker would
+	if (pop_injected(task, false))
+		return true;
+	if (ring_ && ring_->try_pop(task))
+		return true;
+	if (node_queued_.load(std::memory_order_relaxed) > 0)
+	{
+		for (size_t n = 0; n < nodes_.size(); ++n)
+			if (pop_node(n, task))
+				return true;
+	}
+	if (queued_.load(std::memory_order_relaxed) > 0)
+	{
+		const size_t first = next_victim_.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < workers.size(); ++i)
+			if (steal_task(*workers[(first + i) % workers.size()], task))
+				return true;
+	}
+	return false;
+}
 
-	//Task counter and completion condition variable
-	std::atomic<size_t> task_count_{ 0 };  // Atomic counter for unfinished tasks
-	std::condition_variable task_done_cond_;  // Notification for task completion
-};
+inline size_t ThreadPool::tasks_on_stack() const
+{
+	// A worker of this pool only runs user code from inside one of its tasks
+	size_t count = current_worker().pool == this ? 1 : 0;
+	for (const HelpFrame* frame = help_frames(); frame; frame = frame->next)
+		if (frame->pool == this)
+			++count;
+	return count;
+}
 
-// Constructor implementation
-inline ThreadPool::ThreadPool(size_t threads,
-	const std::vector<int>& cpu_affinity,
-	Priority priority)
-	: stop(false), cpu_affinity_(cpu_affinity), priority_(priority)
+inline size_t ThreadPool::size() const
+{
+	if (lazy_.load(std::memory_order_relaxed))
+		return lazy_threads_;
+	// Workers standing in for blocked ones do not count
+	const size_t target = target_threads_.load();
+	return std::max<size_t>(1, target - std::min(target, compensating_.load()));
+}
+
+inline size_t ThreadPool::idle_workers() const
+{
+	// Workers a lazy pool has yet to start count as idle: submitting starts them
+	size_t idle = sleepers_.load(std::memory_order_relaxed);
+	if (lazy_.load(std::memory_order_relaxed))
+		idle += lazy_threads_ - std::min(lazy_threads_, target_threads_.load(std::memory_order_relaxed));
+	return idle;
+}
+
+inline ThreadPool::TraceEvent ThreadPool::trace_event(const char* tag) const
 {
-	for (size_t i = 0; i < threads; ++i)
+	const WorkerContext& context = current_worker();
+	TraceEvent event = { context.pool == this ? context.index : static_cast<size_t>(-1), tag,
+		thread_pool_detail::now_ns() };
+	return event;
+}
+
+inline ThreadPool::Stats ThreadPool::stats() const
+{
+	Stats stats;
+	stats.threads = target_threads_.load(std::memory_order_relaxed);
+	stats.idle_workers = sleepers_.load(std::memory_order_relaxed);
+	stats.queued = tasks_size_.load(std::memory_order_relaxed) + queued_.load(std::memory_order_relaxed)
+		+ node_queued_.load(std::memory_order_relaxed) + (ring_ ? ring_->size_approx() : 0);
+	stats.pending = task_count_.load(std::memory_order_relaxed);
+	stats.tasks_cancelled = tasks_cancelled_.load(std::memory_order_relaxed);
+	stats.workers.resize(workers.size());
+	for (size_t i = 0; i < workers.size(); ++i)
 	{
-		workers.emplace_back([this, i]
-			{
-				// Set CPU affinity (if configured)
-				if (!cpu_affinity_.empty())
-				{
-					int core = cpu_affinity_[i % cpu_affinity_.size()];
-					set_thread_affinity(workers[i], core);
-				}
+		stats.workers[i].active = i < stats.threads;
+		stats.workers[i].queued = workers[i]->size.load(std::memory_order_relaxed);
+	}
 
-				// Set thread priority
-				set_thread_priority(workers[i], priority_);
+#if defined(THREAD_POOL_METRICS)
+	typedef thread_pool_detail::LatencyHistogram Histogram;
+	stats.metrics_enabled = true;
+	const long long now = thread_pool_detail::now_ns();
+	std::vector<unsigned long long> all_wait(Histogram::bucket_count), all_run(Histogram::bucket_count);
+	unsigned long long all_wait_total = 0, all_wait_max = 0, all_run_total = 0, all_run_max = 0;
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		const thread_pool_detail::WorkerMetrics& metrics = workers[i]->metrics;
+		WorkerStats& worker = stats.workers[i];
+		worker.tasks_executed = metrics.tasks.load(std::memory_order_relaxed);
+		worker.steals = metrics.steals.load(std::memory_order_relaxed);
+		stats.tasks_executed += worker.tasks_executed;
 
-				for (;;)
-				{
-					std::function<void()> task;
-					{
-						std::unique_lock<std::mutex> lock(this->queue_mutex);
-						this->condition.wait(lock,
-							[this] { return this->stop || !this->tasks.empty(); });
-						if (this->stop && this->tasks.empty())
-							return;
-						task = std::move(this->tasks.front());
-						this->tasks.pop();
-					}
-					task();
-				}
-			});
+		const long long started = metrics.started_ns.load(std::memory_order_relaxed);
+		if (started > 0 && now > started)
+			worker.utilization = std::min(1.0,
+				static_cast<double>(metrics.busy_ns.load(std::memory_order_relaxed)) / (now - started));
+
+		std::vector<unsigned long long> wait(Histogram::bucket_count), run(Histogram::bucket_count);
+		unsigned long long wait_total = 0, wait_max = 0, run_total = 0, run_max = 0;
+		metrics.queue_wait.collect(wait, wait_total, wait_max);
+		metrics.run_time.collect(run, run_total, run_max);
+		worker.queue_wait = latency_stats(wait, wait_total, wait_max);
+		worker.run_time = latency_stats(run, run_total, run_max);
+
+		metrics.queue_wait.collect(all_wait, all_wait_total, all_wait_max);
+		metrics.run_time.collect(all_run, all_run_total, all_run_max);
 	}
+	stats.queue_wait = latency_stats(all_wait, all_wait_total, all_wait_max);
+	stats.run_time = latency_stats(all_run, all_run_total, all_run_max);
+#endif
+	return stats;
 }
 
-// constructor (numerical priority)
-inline ThreadPool::ThreadPool(size_t threads,
-	const std::vector<int>& cpu_affinity,
-	int custom_priority)
-	: stop(false), cpu_affinity_(cpu_affinity)
+inline ThreadPool::LatencyStats ThreadPool::latency_stats(const std::vector<unsigned long long>& counts,
+	unsigned long long total, unsigned long long max)
 {
-	for (size_t i = 0; i < threads; ++i)
+	LatencyStats stats;
+	for (unsigned long long count : counts)
+		stats.count += count;
+	if (stats.count == 0)
+		return stats;
+	stats.mean_ns = static_cast<double>(total) / stats.count;
+	stats.max_ns = max;
+
+	const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long long* results[] = { &stats.p50_ns, &stats.p90_ns, &stats.p99_ns, &stats.p999_ns };
+	unsigned long long seen = 0;
+	size_t next = 0;
+	for (size_t i = 0; i < counts.size() && next < 4; ++i)
 	{
-		workers.emplace_back([this, i, custom_priority]
-			{
-				// Set CPU affinity (if configured)
-				if (!cpu_affinity_.empty())
-				{
-					int core = cpu_affinity_[i % cpu_affinity_.size()];
-					set_thread_affinity(workers[i], core);
-				}
+		seen += counts[i];
+		while (next < 4 && seen >= quantiles[next] * stats.count)
+			*results[next++] = std::min(max, thread_pool_detail::LatencyHistogram::bucket_value(static_cast<unsigned>(i)));
+	}
+	return stats;
+}
 
-				// Set thread priority (numerical version)
-				set_thread_priority(workers[i], custom_priority);
+inline bool ThreadPool::is_worker_thread() const
+{
+	return current_worker().pool == this;
+}
 
-				for (;;)
-				{
-					std::function<void()> task;
-					{
-						std::unique_lock<std::mutex> lock(this->queue_mutex);
-						this->condition.wait(lock,
-							[this] { return this->stop || !this->tasks.empty(); });
-						if (this->stop && this->tasks.empty())
-							return;
-						task = std::move(this->tasks.front());
-						this->tasks.pop();
-					}
-					task();  // Execute task
-				}
-			});
-	}
+inline size_t ThreadPool::numa_nodes() const
+{
+	return nodes_.size();
 }
 
-// Wait for all tasks to complete (drain)
-inline void ThreadPool::drain()
+inline int ThreadPool::current_numa_node() const
 {
-	std::unique_lock<std::mutex> lock(queue_mutex);
-	// Wait for task counter to reach zero (efficient waiting via condition variable)
-	task_done_cond_.wait(lock, [this] { return task_count_ == 0; });
+	const WorkerContext& context = current_worker();
+	return context.pool == this ? static_cast<int>(workers[context.index]->node) : -1;
 }
 
 // CPU affinity setting implementation (platform-specific)
-inline void ThreadPool::set_thread_affinity(std::thread& thread, int cpu_core)
+inline void ThreadPool::set_thread_affinity(thread_pool_detail::WorkerThread& thread, int cpu_core)
+{
+	set_thread_affinity(thread, CpuSet(1, cpu_core));
+}
+
+// CPU set affinity (platform-specific). Windows threads cannot span processor
+// groups: the group of the first core is used. Linux sets are sized for the
+// highest CPU id, so machines beyond CPU_SETSIZE work too.
+inline void ThreadPool::set_thread_affinity(thread_pool_detail::WorkerThread& thread, const CpuSet& cpu_cores)
 {
+	if (cpu_cores.empty())
+		return;
 #if defined(_WIN32) // Windows implementation
-	DWORD_PTR mask = static_cast<DWORD_PTR>(1) << cpu_core;
-	SetThreadAffinityMask(thread.native_handle(), mask);
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = static_cast<WORD>(cpu_cores[0] / 64);
+	for (int core : cpu_cores)
+		if (core >= 0 && core / 64 == affinity.Group)
+			affinity.Mask |= static_cast<KAFFINITY>(1) << (core % 64);
+	SetThreadGroupAffinity(thread.native_handle(), &affinity, nullptr);
 #elif defined(__linux__) // Linux implementation
-	cpu_set_t cpuset;
-	CPU_ZERO(&cpuset);
-	CPU_SET(cpu_core, &cpuset);
-	pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+	const int count = *std::max_element(cpu_cores.begin(), cpu_cores.end()) + 1;
+	if (count <= 0)
+		return;
+	cpu_set_t* cpuset = CPU_ALLOC(count);
+	if (!cpuset)
+		return;
+	const size_t size = CPU_ALLOC_SIZE(count);
+	CPU_ZERO_S(size, cpuset);
+	for (int core : cpu_cores)
+		if (core >= 0)
+			CPU_SET_S(core, size, cpuset);
+	pthread_setaffinity_np(thread.native_handle(), size, cpuset);
+	CPU_FREE(cpuset);
 #endif
 }
 
+inline ThreadPool::CpuSet ThreadPool::worker_cpu_set(size_t index) const
+{
+	if (!options_.worker_cpus.empty())
+		return options_.worker_cpus[index % options_.worker_cpus.size()];
+	if (!cpu_affinity_.empty())
+		return CpuSet(1, cpu_affinity_[index % cpu_affinity_.size()]);
+	return CpuSet();
+}
+
+inline std::vector<ThreadPool::CpuSet> ThreadPool::physical_cores()
+{
+	return thread_pool_detail::core_topology();
+}
+
+inline std::vector<ThreadPool::CpuSet> ThreadPool::l3_domains()
+{
+	return thread_pool_detail::l3_topology();
+}
+
+inline std::vector<ThreadPool::CpuSet> ThreadPool::numa_domains()
+{
+	return thread_pool_detail::numa_topology();
+}
+
+inline std::vector<int> ThreadPool::smt_spread_order()
+{
+	const std::vector<CpuSet> cores = physical_cores();
+	std::vector<int> order;
+	for (size_t sibling = 0;; ++sibling)
+	{
+		bool any = false;
+		for (const CpuSet& core : cores)
+		{
+			if (sibling < core.size())
+			{
+				order.push_back(core[sibling]);
+				any = true;
+			}
+		}
+		if (!any)
+			break;
+	}
+	return order;
+}
+
 // Thread priority setting implementation (platform-specific)
-inline void ThreadPool::set_thread_priority(std::thread& thread, Priority priority)
+inline void ThreadPool::set_thread_priority(thread_pool_detail::WorkerThread& thread, Priority priority)
 {
 #if defined(_WIN32) // Windows implementation
 	int win_priority;
@@ -232,36 +4125,283 @@ inline void ThreadPool::set_thread_priority(std::thread& thread, Priority priori
 // Task enqueue (modified: added task counting)
 template<class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
--> std::future<typename std::result_of<F(Args...)>::type>
+-> typename thread_pool_detail::task_future<F, Args...>::type
+{
+	return enqueue(TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Task enqueue with priority level
+template<class F, class... Args>
+auto ThreadPool::enqueue(TaskPriority priority, F&& f, Args&&... args)
+-> typename thread_pool_detail::task_future<F, Args...>::type
+{
+	TaskOptions options;
+	options.priority = priority;
+	return enqueue(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Task enqueue with per-task options
+template<class F, class... Args>
+auto ThreadPool::enqueue(const TaskOptions& options, F&& f, Args&&... args)
+-> typename thread_pool_detail::task_future<F, Args...>::type
+{
+	using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+	typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+	typedef thread_pool_detail::PromiseTask<return_type, bound_type> task_type;
+
+	task_type task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+	std::future<return_type> res = task.promise.get_future();
+	Task queued = make_task(options, std::move(task));
+	if (admit(1))
+		push_task(std::move(queued), options);
+	else
+		run_inline(queued);
+	return res;
+}
+
+// Task enqueue that gives up when a bounded queue is full
+template<class F, class... Args>
+auto ThreadPool::try_enqueue(F&& f, Args&&... args)
+-> typename thread_pool_detail::task_future<F, Args...>::type
 {
-	using return_type = typename std::result_of<F(Args...)>::type;
+	using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+	typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+	typedef thread_pool_detail::PromiseTask<return_type, bound_type> task_type;
+
+	if (options_.max_pending > 0 && task_count_.load(std::memory_order_relaxed) >= options_.max_pending)
+		return std::future<return_type>();
 
-	auto task = std::make_shared<std::packaged_task<return_type()>>(
-		std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-	);
+	task_type task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+	std::future<return_type> res = task.promise.get_future();
+	if (!try_push_task(Task(std::move(task))))
+		return std::future<return_type>();
+	return res;
+}
+
+// Bulk enqueue of a range of callables
+template<class InputIt>
+auto ThreadPool::enqueue_bulk(InputIt first, InputIt last)
+-> std::vector<std::future<typename thread_pool_detail::invoke_result<
+	typename std::iterator_traits<InputIt>::reference>::type>>
+{
+	typedef typename std::iterator_traits<InputIt>::reference reference;
+	typedef typename thread_pool_detail::invoke_result<reference>::type return_type;
+	typedef typename std::decay<reference>::type callable_type;
+	typedef thread_pool_detail::PromiseTask<return_type, callable_type> task_type;
 
-	std::future<return_type> res = task->get_future();
+	std::vector<std::future<return_type>> results;
+	std::vector<Task> batch;
+	for (; first != last; ++first)
 	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
+		task_type task(*first);
+		results.push_back(task.promise.get_future());
+		batch.emplace_back(std::move(task));
+	}
+	if (admit(batch.size()))
+		push_tasks(batch);
+	else
+		for (Task& task : batch)
+			run_inline(task);
+	return results;
+}
 
-		if (stop)
-			throw std::runtime_error("enqueue on stopped ThreadPool");
+// Bulk enqueue of f(0) ... f(count - 1) with one aggregate completion future
+template<class F>
+std::future<void> ThreadPool::enqueue_bulk(size_t count, F&& f)
+{
+	typedef thread_pool_detail::BulkState<typename std::decay<F>::type> state_type;
+	typedef thread_pool_detail::BulkTask<typename std::decay<F>::type> task_type;
 
-		// Decrease counter and notify after task execution
-		tasks.emplace([task, this]()
-			{
-				(*task)();
-				task_count_--;
-				task_done_cond_.notify_one();  // Notify drain() of task completion
-			});
-		task_count_++;  // Increase counter when enqueuing
+	std::shared_ptr<state_type> state = thread_pool_detail::make_shared_state<state_type>(std::forward<F>(f), count);
+	std::future<void> result = state->promise.get_future();
+	if (count == 0)
+	{
+		state->promise.set_value();
+		return result;
+	}
+
+	std::vector<Task> batch;
+	batch.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		task_type task = { state, i };
+		batch.emplace_back(std::move(task));
 	}
-	condition.notify_one();
+	if (admit(count))
+		push_tasks(batch);
+	else
+		for (Task& task : batch)
+			run_inline(task);
+	return result;
+}
+
+// Delayed task submission
+template<class Rep, class Period, class F, class... Args>
+auto ThreadPool::enqueue_after(std::chrono::duration<Rep, Period> delay, F&& f, Args&&... args)
+-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>
+{
+	using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+	typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+	typedef thread_pool_detail::PromiseTask<return_type, bound_type> task_type;
+
+	task_type task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+	std::future<return_type> res = task.promise.get_future();
+	thread_pool_detail::TimerNode* node = new thread_pool_detail::TimerNode();
+	node->task = Task(std::move(task));
+	add_timer(node, timer_deadline(delay));
 	return res;
 }
 
+template<class Clock, class Duration, class F, class... Args>
+auto ThreadPool::enqueue_at(const std::chrono::time_point<Clock, Duration>& time, F&& f, Args&&... args)
+-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>
+{
+	return enqueue_after(time - Clock::now(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Periodic task submission
+template<class Rep, class Period, class F>
+ThreadPool::CancellationSource ThreadPool::schedule_every(std::chrono::duration<Rep, Period> period, F&& f)
+{
+	CancellationSource source;
+	std::shared_ptr<thread_pool_detail::PeriodicTimer> timer =
+		thread_pool_detail::make_shared_state<thread_pool_detail::PeriodicTimer>();
+	timer->fn = std::forward<F>(f);
+	timer->cancel = source.token().state_;
+	const long long period_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+	timer->period = static_cast<unsigned long long>(std::max(1LL, (period_ns + timer_tick_ns_ - 1) / timer_tick_ns_));
+
+	thread_pool_detail::TimerNode* node = new thread_pool_detail::TimerNode();
+	node->periodic = timer;
+	add_timer(node, timer_deadline(period));
+	return source;
+}
+
+// Fire-and-forget task submission
+template<class F, class... Args>
+auto ThreadPool::post(F&& f, Args&&... args)
+-> typename thread_pool_detail::enable_if_callable<F>::type
+{
+	post(TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Fire-and-forget task submission with priority level
+template<class F, class... Args>
+void ThreadPool::post(TaskPriority priority, F&& f, Args&&... args)
+{
+	TaskOptions options;
+	options.priority = priority;
+	post(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Fire-and-forget task submission with per-task options
+template<class F, class... Args>
+void ThreadPool::post(const TaskOptions& options, F&& f, Args&&... args)
+{
+	Task task = make_task(options, std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+	if (admit(1))
+		push_task(std::move(task), options);
+	else
+		run_inline(task);
+}
+
+inline void ThreadPool::set_exception_handler(std::function<void(std::exception_ptr)> handler)
+{
+	std::lock_guard<std::mutex> lock(handler_mutex_);
+	exception_handler_ = std::move(handler);
+}
+
+inline void ThreadPool::set_allocator(const AllocatorHooks* hooks)
+{
+	thread_pool_detail::allocator_hooks().store(hooks ? hooks : thread_pool_detail::arena_hooks(),
+		std::memory_order_release);
+}
+
+inline void ThreadPool::set_trace_hooks(const TraceHooks& hooks)
+{
+	std::lock_guard<std::mutex> lock(handler_mutex_);
+	const bool empty = !hooks.on_task_begin && !hooks.on_task_end && !hooks.on_idle && !hooks.on_wake;
+	if (!empty)
+		trace_history_.emplace_back(new TraceHooks(hooks));
+	trace_hooks_.store(empty ? nullptr : trace_history_.back().get(), std::memory_order_seq_cst);
+	trace_retired_.store(trace_history_.size() > (empty ? 0u : 1u), std::memory_order_seq_cst);
+	reclaim_trace_hooks();
+}
+
+inline std::atomic<unsigned>& ThreadPool::trace_pins()
+{
+	const WorkerContext& context = current_worker();
+	return context.pool == this ? workers[context.index]->trace_pins : trace_pins_;
+}
+
+inline const ThreadPool::TraceHooks* ThreadPool::pin_trace_hooks(std::atomic<unsigned>& pins)
+{
+	if (!trace_hooks_.load(std::memory_order_relaxed))
+		return nullptr;
+	// Pin, then load: reclaim_trace_hooks() either sees the pin or runs after
+	// the replacement, which this load then returns
+	pins.fetch_add(1, std::memory_order_seq_cst);
+	const TraceHooks* hooks = trace_hooks_.load(std::memory_order_seq_cst);
+	if (!hooks)
+		unpin_trace_hooks(pins);
+	return hooks;
+}
+
+inline void ThreadPool::unpin_trace_hooks(std::atomic<unsigned>& pins)
+{
+	// The last pin out frees what set_trace_hooks() could not
+	if (pins.fetch_sub(1, std::memory_order_seq_cst) == 1 && trace_retired_.load(std::memory_order_seq_cst))
+	{
+		std::lock_guard<std::mutex> lock(handler_mutex_);
+		reclaim_trace_hooks();
+	}
+}
+
+inline void ThreadPool::reclaim_trace_hooks()
+{
+	if (!trace_retired_.load(std::memory_order_relaxed) || trace_pins_.load(std::memory_order_seq_cst) > 0)
+		return;
+	for (const std::unique_ptr<Worker>& worker : workers)
+		if (worker->trace_pins.load(std::memory_order_seq_cst) > 0)
+			return;
+	const TraceHooks* current = trace_hooks_.load(std::memory_order_relaxed);
+	trace_history_.erase(std::remove_if(trace_history_.begin(), trace_history_.end(),
+		[current](const std::unique_ptr<TraceHooks>& hooks) { return hooks.get() != current; }),
+		trace_history_.end());
+	trace_retired_.store(false, std::memory_order_relaxed);
+}
+
+inline void ThreadPool::handle_exception(std::exception_ptr error)
+{
+	std::function<void(std::exception_ptr)> handler;
+	{
+		std::lock_guard<std::mutex> lock(handler_mutex_);
+		handler = exception_handler_;
+	}
+	try
+	{
+		if (handler)
+		{
+			handler(error);
+			return;
+		}
+		std::rethrow_exception(error);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "ThreadPool: exception in posted task: " << e.what() << std::endl;
+	}
+	catch (...)
+	{
+		std::cerr << "ThreadPool: unknown exception in posted task" << std::endl;
+	}
+}
+
 // Thread priority setting (numerical version)
-inline void ThreadPool::set_thread_priority(std::thread& thread, int custom_priority)
+inline void ThreadPool::set_thread_priority(thread_pool_detail::WorkerThread& thread, int custom_priority)
 {
 #if defined(_WIN32)
 	// Windows priority range: THREAD_PRIORITY_LOWEST(-2) to THREAD_PRIORITY_TIME_CRITICAL(15)
@@ -288,16 +4428,89 @@ inline void ThreadPool::set_thread_priority(std::thread& thread, int custom_prio
 #endif
 }
 
+namespace thread_pool_detail
+{
+	template<>
+	struct is_task_option<ThreadPool::TaskPriority> : std::true_type {};
+
+	template<>
+	struct is_task_option<ThreadPool::TaskOptions> : std::true_type {};
+
+	struct pool_access
+	{
+		template<class F>
+		static void post(ThreadPool& pool, F&& f) { pool.push_task(Task(std::forward<F>(f))); }
+
+		// A Task goes in as it is and stays with the caller if push_task() throws
+		static void post(ThreadPool& pool, Task&& task) { pool.push_task(std::move(task)); }
+
+		static void handle_exception(ThreadPool& pool, std::exception_ptr error) { pool.handle_exception(error); }
+
+		// post() of a callable as it is, without std::bind, so a cancel_task()
+		// overload for it still applies when the task is dropped
+		template<class F>
+		static void submit(ThreadPool& pool, const ThreadPool::TaskOptions& options, F&& f)
+		{
+			Task task = pool.make_task(options, std::forward<F>(f));
+			if (pool.admit(1))
+				pool.push_task(std::move(task), options);
+			else
+				pool.run_inline(task);
+		}
+
+		static void submit_bulk(ThreadPool& pool, std::vector<Task>& batch)
+		{
+			if (pool.admit(batch.size()))
+				pool.push_tasks(batch);
+			else
+				for (Task& task : batch)
+					pool.run_inline(task);
+		}
+	};
+
+	// Task body of enqueue_blocking()
+	template<class R, class Fn>
+	struct BlockingCall
+	{
+		ThreadPool* pool;
+		Fn fn;
+
+		R operator()()
+		{
+			ThreadPool::BlockingScope scope(*pool);
+			return fn();
+		}
+	};
+}
+
+// Blocking task enqueue
+template<class F, class... Args>
+auto ThreadPool::enqueue_blocking(F&& f, Args&&... args)
+-> std::future<typename thread_pool_detail::invoke_result<F, Args...>::type>
+{
+	using return_type = typename thread_pool_detail::invoke_result<F, Args...>::type;
+
+	typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) bound_type;
+	thread_pool_detail::BlockingCall<return_type, bound_type> call = {
+		this, std::bind(std::forward<F>(f), std::forward<Args>(args)...) };
+	return enqueue(std::move(call));
+}
+
 // Destructor implementation
 inline ThreadPool::~ThreadPool()
 {
 	{
+		// No worker is spawned or retired past this point, and no timer fires
+		std::lock_guard<std::mutex> timer_lock(timer_mutex_);
+		std::lock_guard<std::mutex> resize_lock(resize_mutex_);
 		std::unique_lock<std::mutex> lock(queue_mutex);
 		stop = true;
 	}
 	condition.notify_all();
-	for (std::thread& worker : workers)
-		worker.join();
+	timer_cond_.notify_all();
+	for (std::unique_ptr<Worker>& worker : workers)
+		if (worker->thread.joinable())
+			worker->thread.join();
 }
 
 #endif
\ No newline at end of file
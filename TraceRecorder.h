@@ -0,0 +1,170 @@
+﻿#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include "ThreadPool.h"
+
+#include <fstream>
+#include <ostream>
+#include <string>
+
+// Records task and idle spans of a pool into one ring buffer per worker and
+// writes them as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Every buffer has a single writer, its worker, so recording is a couple of
+// plain stores plus a release store of the write position. When a buffer is
+// full the oldest events are overwritten. Tags are copied into the event
+// (truncated to max_tag_length characters), so they need not outlive their
+// task. Write the trace after drain() or detach(); events recorded while
+// writing may be torn. Like any hook owner the recorder must outlive the tasks
+// running while it was attached.
+class TraceRecorder
+{
+public:
+	static const size_t max_tag_length = 47;
+
+	explicit TraceRecorder(size_t events_per_worker = 1 << 16)
+		: capacity_(round_up(events_per_worker)), pool_(nullptr)
+	{
+	}
+
+	~TraceRecorder() { detach(); }
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	// Install the recording hooks on pool (replacing any other trace hooks).
+	// Attach while no task runs: earlier events are dropped.
+	void attach(ThreadPool& pool)
+	{
+		detach();
+		const size_t slots = pool.stats().workers.size();
+		buffers_.clear();
+		for (size_t i = 0; i < slots; ++i)
+			buffers_.emplace_back(new Buffer(capacity_));
+		origin_ns_ = thread_pool_detail::now_ns();
+		pool_ = &pool;
+
+		ThreadPool::TraceHooks hooks;
+		hooks.on_task_begin = [this](const ThreadPool::TraceEvent& event) { record(event, 'B'); };
+		hooks.on_task_end = [this](const ThreadPool::TraceEvent& event) { record(event, 'E'); };
+		hooks.on_idle = [this](const ThreadPool::TraceEvent& event) { record(event, 'b'); };
+		hooks.on_wake = [this](const ThreadPool::TraceEvent& event) { record(event, 'e'); };
+		pool.set_trace_hooks(hooks);
+	}
+
+	// Remove the hooks again; recorded events are kept
+	void detach()
+	{
+		if (!pool_)
+			return;
+		pool_->set_trace_hooks(ThreadPool::TraceHooks());
+		pool_ = nullptr;
+	}
+
+	// Write the events as {"traceEvents": [...]}. Tasks are duration events
+	// named by their tag, idle (parked) time is an "idle" span; one track per worker.
+	void write_chrome_trace(std::ostream& out) const
+	{
+		const std::ios_base::fmtflags flags = out.flags();
+		out << std::fixed << "{\"traceEvents\": [";
+		bool first = true;
+		for (size_t worker = 0; worker < buffers_.size(); ++worker)
+		{
+			out << (first ? "\n" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+				<< worker << ", \"args\": {\"name\": \"worker " << worker << "\"}}";
+			first = false;
+
+			const Buffer& buffer = *buffers_[worker];
+			const size_t end = buffer.head.load(std::memory_order_acquire);
+			const size_t begin = end > capacity_ ? end - capacity_ : 0;
+			size_t depth = 0;
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Event& event = buffer.events[i & (capacity_ - 1)];
+				const bool idle = event.phase == 'b' || event.phase == 'e';
+				const char phase = idle ? (event.phase == 'b' ? 'B' : 'E') : event.phase;
+				// Skip ends whose begin was overwritten or happened before attach()
+				if (phase == 'E' && depth == 0)
+					continue;
+				depth += phase == 'B' ? 1 : -1;
+				out << ",\n{\"ph\": \"" << phase << "\", \"pid\": 1, \"tid\": " << worker
+					<< ", \"ts\": " << (event.time_ns - origin_ns_) / 1000.0;
+				if (phase == 'B')
+				{
+					out << ", \"name\": \"";
+					write_escaped(out, idle ? "idle" : (event.tag[0] ? event.tag : "task"));
+					out << "\", \"cat\": \"" << (idle ? "idle" : "task") << "\"";
+				}
+				out << "}";
+			}
+		}
+		out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+		out.flags(flags);
+	}
+
+	bool write_chrome_trace(const std::string& path) const
+	{
+		std::ofstream out(path.c_str());
+		write_chrome_trace(out);
+		return static_cast<bool>(out);
+	}
+
+private:
+	struct Event
+	{
+		long long time_ns;
+		char tag[max_tag_length + 1];  // Empty if untagged
+		char phase;  // B/E task, b/e idle
+	};
+
+	struct Buffer
+	{
+		explicit Buffer(size_t capacity) : events(new Event[capacity]), head(0) {}
+
+		std::unique_ptr<Event[]> events;
+		std::atomic<size_t> head;
+	};
+
+	static size_t round_up(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		return size;
+	}
+
+	static void write_escaped(std::ostream& out, const char* text)
+	{
+		for (; *text; ++text)
+		{
+			if (*text == '"' || *text == '\\')
+				out << '\\' << *text;
+			else if (static_cast<unsigned char>(*text) >= 0x20)
+				out << *text;
+		}
+	}
+
+	void record(const ThreadPool::TraceEvent& event, char phase)
+	{
+		if (event.worker >= buffers_.size())
+			return;  // Not one of the pool's workers
+		Buffer& buffer = *buffers_[event.worker];
+		const size_t head = buffer.head.load(std::memory_order_relaxed);
+		Event& slot = buffer.events[head & (capacity_ - 1)];
+		slot.time_ns = event.time_ns;
+		size_t length = 0;
+		if (event.tag)
+			for (; length < max_tag_length && event.tag[length]; ++length)
+				slot.tag[length] = event.tag[length];
+		slot.tag[length] = '\0';
+		slot.phase = phase;
+		buffer.head.store(head + 1, std::memory_order_release);
+	}
+
+	const size_t capacity_;
+	ThreadPool* pool_;
+	long long origin_ns_ = 0;
+	std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+#endif
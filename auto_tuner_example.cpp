@@ -0,0 +1,73 @@
+﻿#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#define THREAD_POOL_METRICS
+#include "AutoTuner.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	ThreadPool::Options options;
+	options.max_threads = 8;
+	ThreadPool pool(1, {}, ThreadPool::Priority::NORMAL, options);
+
+	std::mutex mutex;
+	std::vector<AutoTuner::Decision> decisions;
+	AutoTuner::Options tuning;
+	tuning.max_threads = 4;
+	tuning.interval = std::chrono::milliseconds(50);
+	tuning.min_tasks = 10;
+	tuning.on_decision = [&](const AutoTuner::Decision& decision)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		decisions.push_back(decision);
+	};
+
+	{
+		AutoTuner tuner(pool, tuning);
+		check(!pool.auto_sizing(), "the pool's own sizing is paused while the tuner runs");
+
+		// Waiting tasks: every added thread gains throughput, whatever the core
+		// count, so the tuner climbs to its bound
+		std::atomic<bool> stop(false);
+		std::atomic<int> done(0);
+		for (int i = 0; i < 20000; ++i)
+			pool.post([&] { if (!stop) std::this_thread::sleep_for(std::chrono::milliseconds(1)); done++; });
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (pool.size() < 4 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		check(pool.size() == 4, "a backlog of waiting tasks grows the pool to max_threads");
+		stop = true;
+		pool.drain();
+
+		// Without a backlog there is nothing to learn: the count holds
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		const AutoTuner::Decision last = tuner.last_decision();
+		check(last.action == AutoTuner::Action::HOLD && pool.size() == 4, "an idle pool keeps its thread count");
+	}
+	check(pool.auto_sizing(), "the pool's own sizing resumes after the tuner");
+
+	bool grew = false, bounded = true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const AutoTuner::Decision& decision : decisions)
+		{
+			grew = grew || decision.action == AutoTuner::Action::GROW;
+			bounded = bounded && decision.next_threads <= 4;
+		}
+	}
+	check(grew && bounded, "decisions grow and stay within the tuner's bounds");
+
+	return failures == 0 ? 0 : 1;
+}
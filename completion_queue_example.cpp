@@ -0,0 +1,76 @@
+﻿#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "CompletionQueue.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	ThreadPool pool(4);
+	CompletionQueue<int> results(pool);
+
+	// Results arrive in completion order, not in submission order: the task
+	// submitted first finishes last
+	results.submit(0, [] { std::this_thread::sleep_for(std::chrono::milliseconds(200)); return 0; });
+	results.submit(1, [] { return 10; });
+	Completion<int> first;
+	check(results.pop(first) && first.id() == 1 && first.get() == 10, "results come in completion order");
+	Completion<int> second;
+	check(results.pop(second) && second.id() == 0 && second.get() == 0, "the slow result follows");
+
+	// Every bulk result arrives once, with its id
+	const size_t count = 1000;
+	results.submit_bulk(100, count, [](size_t i) { return static_cast<int>(i) * 2; });
+	std::vector<Completion<int>> batch;
+	while (batch.size() < count && results.pop_batch(batch, 1) > 0)
+	{
+	}
+	std::vector<bool> seen(count, false);
+	bool exact = batch.size() == count;
+	for (Completion<int>& c : batch)
+	{
+		const size_t i = static_cast<size_t>(c.id() - 100);
+		exact = exact && i < count && !seen[i] && c.get() == static_cast<int>(i) * 2;
+		if (i < count)
+			seen[i] = true;
+	}
+	check(exact && results.outstanding() == 0, "each bulk result arrives once with its id");
+
+	// A failed task delivers its exception; pop() on an empty queue returns
+	results.submit(7, []() -> int { throw std::runtime_error("task"); });
+	Completion<int> failed;
+	bool rethrown = false;
+	if (results.pop(failed) && failed.failed())
+	{
+		try
+		{
+			failed.get();
+		}
+		catch (const std::runtime_error&)
+		{
+			rethrown = true;
+		}
+	}
+	check(rethrown, "a failed task's exception is rethrown by get()");
+	Completion<int> none;
+	check(!results.pop(none) && !results.try_pop(none), "pop() returns false with nothing outstanding");
+
+	// pop_batch_for() gives up after its timeout with what is ready
+	results.submit(8, [] { std::this_thread::sleep_for(std::chrono::milliseconds(300)); return 8; });
+	std::vector<Completion<int>> partial;
+	const size_t taken = results.pop_batch_for(partial, std::chrono::milliseconds(20), 1);
+	check(taken == 0 && results.outstanding() == 1, "pop_batch_for() stops at its timeout");
+	check(results.pop(none) && none.get() == 8, "the late result still arrives");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,34 @@
+﻿#include <iostream>
+#include <string>
+
+#include "Coroutine.h"
+
+CoTask<int> square(ThreadPool& pool, int i)
+{
+	co_await pool.schedule();  // continue on a worker
+	co_return i * i;
+}
+
+CoTask<int> sum_of_squares(ThreadPool& pool, int count)
+{
+	int sum = 0;
+	for (int i = 0; i < count; ++i)
+		sum += co_await square(pool, i);
+
+	// Await a plain pool task without blocking the worker
+	int extra = co_await async_task(pool, [] { return 1000; });
+	co_return sum + extra;
+}
+
+int main()
+{
+	ThreadPool pool(4);
+
+	TaskFuture<int> result = co_spawn(pool, sum_of_squares(pool, 10));
+	result.then([](const int& value)
+		{
+			std::cout << "sum " << value << std::endl;
+		}).wait();
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+﻿#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "ParallelFor.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	ThreadPool pool(4);
+	const int n = 100000;
+
+	// Every index is visited exactly once, whatever the partitioner
+	const Partitioner partitioners[] = { Partitioner::STATIC, Partitioner::GUIDED, Partitioner::AUTO };
+	const char* names[] = { "parallel_for STATIC visits each index once",
+		"parallel_for GUIDED visits each index once", "parallel_for AUTO visits each index once" };
+	for (int p = 0; p < 3; ++p)
+	{
+		std::vector<std::atomic<int>> visits(n);
+		for (std::atomic<int>& v : visits)
+			v = 0;
+		parallel_for(pool, 0, n, 0, [&](int i) { visits[i]++; }, partitioners[p]);
+		bool once = true;
+		for (const std::atomic<int>& v : visits)
+			once = once && v == 1;
+		check(once, names[p]);
+	}
+
+	// The reduction matches the serial sum
+	long long sum = parallel_reduce(pool, 0, n, 1024, 0LL,
+		[](int first, int last, long long acc) { for (int i = first; i < last; ++i) acc += i; return acc; },
+		[](long long a, long long b) { return a + b; });
+	check(sum == static_cast<long long>(n) * (n - 1) / 2, "parallel_reduce equals the serial sum");
+
+	// The first exception of the body is rethrown after the loop
+	bool threw = false;
+	try
+	{
+		parallel_for(pool, 0, n, 0, [](int i) { if (i == n / 2) throw std::runtime_error("body"); });
+	}
+	catch (const std::runtime_error&)
+	{
+		threw = true;
+	}
+	check(threw, "parallel_for rethrows the body's exception");
+
+	// Loops nested in pool tasks finish: callers take part instead of blocking
+	std::atomic<long long> nested(0);
+	std::vector<std::future<void>> outer;
+	for (int t = 0; t < 8; ++t)
+		outer.push_back(pool.enqueue([&pool, &nested]
+			{
+				parallel_for(pool, 0, 1000, 0, [&nested](int i) { nested += i; });
+			}));
+	for (std::future<void>& f : outer)
+		f.get();
+	check(nested == 8LL * 1000 * 999 / 2, "parallel_for nested in pool tasks completes");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+﻿#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "Strand.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	ThreadPool pool(4);
+
+	// Tasks of one strand never overlap and run in posting order, while
+	// several strands share the workers
+	const int strands = 4, tasks = 5000;
+	std::vector<std::unique_ptr<Strand>> lanes;
+	std::vector<std::vector<int>> seen(strands);
+	std::vector<std::atomic<int>> inside(strands);
+	std::atomic<bool> overlapped(false), outside(false);
+	for (int s = 0; s < strands; ++s)
+	{
+		lanes.emplace_back(new Strand(pool, 8));
+		inside[s] = 0;
+	}
+	for (int i = 0; i < tasks; ++i)
+	{
+		for (int s = 0; s < strands; ++s)
+		{
+			Strand& lane = *lanes[s];
+			lanes[s]->post([&, s, i]
+				{
+					if (inside[s]++ != 0)
+						overlapped = true;
+					if (!lane.running_in_this_thread())
+						outside = true;
+					seen[s].push_back(i);  // Unsynchronized: the strand serializes it
+					inside[s]--;
+				});
+		}
+	}
+	std::future<int> last = lanes[0]->enqueue([] { return 7; });
+	check(last.get() == 7, "enqueue() returns the task's result");
+	pool.drain();
+
+	bool fifo = true;
+	for (int s = 0; s < strands; ++s)
+	{
+		fifo = fifo && seen[s].size() == static_cast<size_t>(tasks);
+		for (int i = 0; fifo && i < tasks; ++i)
+			fifo = seen[s][i] == i;
+	}
+	check(!overlapped, "tasks of a strand never overlap");
+	check(fifo, "tasks of a strand run in posting order");
+	check(!outside && !lanes[0]->running_in_this_thread(), "running_in_this_thread() tells the strand's tasks apart");
+
+	// Tasks still queued when the strand goes away run all the same
+	std::atomic<int> ran(0);
+	{
+		Strand lane(pool);
+		for (int i = 0; i < 100; ++i)
+			lane.post([&ran] { ran++; });
+	}
+	pool.drain();
+	check(ran == 100, "tasks queued at destruction still run");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+﻿#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "TaskGraph.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	ThreadPool pool(4);
+
+	// Continuations run once the value is there, errors skip them
+	TaskFuture<int> chained = async_task(pool, [] { return 20; }).then([](int v) { return v + 1; }).then([](int v) { return v * 2; });
+	check(chained.get() == 42, "then() chains values");
+	TaskFuture<int> failed = async_task(pool, []() -> int { throw std::runtime_error("source"); }).then([](int v) { return v; });
+	bool propagated = false;
+	try
+	{
+		failed.get();
+	}
+	catch (const std::runtime_error&)
+	{
+		propagated = true;
+	}
+	check(propagated, "then() passes the source's exception on");
+
+	// when_all keeps input order, when_any reports a ready input
+	std::vector<TaskFuture<int>> inputs;
+	for (int i = 0; i < 8; ++i)
+		inputs.push_back(async_task(pool, [i] { std::this_thread::sleep_for(std::chrono::milliseconds(8 - i)); return i; }));
+	std::vector<int> all = when_all(pool, inputs.begin(), inputs.end()).get();
+	bool ordered = all.size() == 8;
+	for (int i = 0; ordered && i < 8; ++i)
+		ordered = all[i] == i;
+	check(ordered, "when_all() collects values in input order");
+	TaskFuture<int> never = TaskPromise<int>(pool).get_future();
+	std::vector<TaskFuture<int>> race = { never, async_task(pool, [] { return 7; }) };
+	size_t first = when_any(pool, race.begin(), race.end()).get();
+	check(first == 1, "when_any() reports the input that became ready");
+
+	// A promise is satisfied once
+	TaskPromise<int> promise(pool);
+	promise.set_value(1);
+	bool rejected = false;
+	try
+	{
+		promise.set_value(2);
+	}
+	catch (const std::future_error& error)
+	{
+		rejected = error.code() == std::future_errc::promise_already_satisfied;
+	}
+	check(rejected && promise.get_future().get() == 1, "a second set_value() throws promise_already_satisfied");
+
+	// Graph: a task starts only after its predecessors
+	std::atomic<int> order(0);
+	int fetched = -1, parsed = -1, indexed = -1, written = -1;
+	TaskGraph graph;
+	TaskGraph::Node fetch = graph.add([&] { fetched = order++; });
+	TaskGraph::Node parse = graph.add([&] { parsed = order++; }, { fetch });
+	TaskGraph::Node index = graph.add([&] { indexed = order++; }, { fetch });
+	graph.add([&] { written = order++; }, { parse, index });
+	graph.run(pool).get();
+	check(fetched == 0 && parsed > fetched && indexed > fetched && written == 3, "graph tasks run after their predecessors");
+
+	// Failure: the run fails, dependents are skipped, independent branches run
+	std::atomic<int> dependent(0), independent(0);
+	TaskGraph failing;
+	TaskGraph::Node bad = failing.add([] { throw std::runtime_error("node"); });
+	failing.add([&] { dependent++; }, { bad });
+	failing.add([&] { std::this_thread::sleep_for(std::chrono::milliseconds(1)); independent++; });
+	bool run_failed = false;
+	try
+	{
+		failing.run(pool).get();
+	}
+	catch (const std::runtime_error&)
+	{
+		run_failed = true;
+	}
+	check(run_failed && dependent == 0 && independent == 1, "a failed graph task skips only its dependents");
+
+	// Shutdown: continuations the stopped pool refuses still complete their futures
+	TaskFuture<int> late;
+	TaskFuture<void> late_graph;
+	{
+		ThreadPool* doomed = new ThreadPool(1);
+		TaskFuture<int> slow = async_task(*doomed, [] { std::this_thread::sleep_for(std::chrono::milliseconds(100)); return 1; });
+		late = slow.then([](int v) { return v + 1; });
+		TaskGraph pair;
+		TaskGraph::Node head = pair.add([] { std::this_thread::sleep_for(std::chrono::milliseconds(50)); });
+		pair.add([] {}, { head });
+		late_graph = pair.run(*doomed);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		delete doomed;
+	}
+	check(late.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "a continuation refused at shutdown completes");
+	check(late_graph.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "a graph cut short by shutdown completes");
+
+	return failures == 0 ? 0 : 1;
+}
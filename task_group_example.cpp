@@ -0,0 +1,104 @@
+﻿#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "TaskGroup.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+// Busy for about 200 microseconds, so both groups keep a backlog
+static void work()
+{
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::microseconds(200);
+	while (std::chrono::steady_clock::now() < end)
+	{
+	}
+}
+
+int main()
+{
+	ThreadPool pool(2);
+	GroupScheduler tenants(pool);
+
+	// Fair share: while both are busy, a weight 3 group gets three times the
+	// pool time of a weight 1 group. One worker, so the share does not depend
+	// on how many cores run the pool.
+	{
+		ThreadPool one(1);
+		GroupScheduler shared(one);
+		TaskGroup heavy(shared, 3);
+		TaskGroup light(shared, 1);
+		std::atomic<int> heavy_done(0), light_done(0), light_at_sample(-1);
+		for (int i = 0; i < 600; ++i)
+		{
+			heavy.post([&]
+				{
+					work();
+					if (++heavy_done == 300)
+						light_at_sample = light_done.load();
+				});
+			light.post([&] { work(); light_done++; });
+		}
+		heavy.drain();
+		light.drain();
+		const double ratio = light_at_sample > 0 ? 300.0 / light_at_sample : 0;
+		std::cout << "      heavy:light " << ratio << std::endl;
+		check(ratio > 2 && ratio < 4.5, "pool time follows the group weights");
+	}
+
+	// max_concurrency caps the tasks of a group running at once
+	{
+		TaskGroup capped(tenants, 1, 1);
+		std::atomic<int> running(0), peak(0);
+		for (int i = 0; i < 50; ++i)
+			capped.post([&]
+				{
+					const int now = ++running;
+					if (now > peak)
+						peak = now;
+					work();
+					running--;
+				});
+		capped.drain();
+		check(peak == 1, "max_concurrency caps running tasks");
+	}
+
+	// cancel() drops the queued tasks, their futures throw TaskCancelled
+	{
+		ThreadPool one(1);
+		GroupScheduler scheduler(one);
+		TaskGroup group(scheduler);
+		std::promise<void> gate;
+		std::shared_future<void> opened = gate.get_future().share();
+		group.post([opened] { opened.wait(); });
+		std::vector<std::future<int>> queued;
+		for (int i = 0; i < 10; ++i)
+			queued.push_back(group.enqueue([i] { return i; }));
+		group.cancel();
+		gate.set_value();
+		int cancelled = 0;
+		for (std::future<int>& f : queued)
+		{
+			try
+			{
+				f.get();
+			}
+			catch (const ThreadPool::TaskCancelled&)
+			{
+				++cancelled;
+			}
+		}
+		group.drain();
+		check(cancelled == 10 && group.pending() == 0, "cancel() fails the queued tasks' futures");
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,337 @@
+﻿// ThreadPool benchmark: throughput, enqueue-to-start latency and drain() cost
+// for each scheduling mode, thread count and affinity setting. Results are
+// printed as one JSON array on stdout; latency_ns is enqueue-to-start for
+// tiny_enqueue and the duration of drain() for drain.
+//
+// Usage: threadpool_bench [--threads 1,2,4] [--tasks N] [--repeat N] [--batch N] [--quick]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Config
+	{
+		std::vector<size_t> threads;
+		size_t tasks = 200000;
+		size_t repeat = 3;
+		size_t batch = 0;  // Options::dequeue_batch
+	};
+
+	struct Setup
+	{
+		ThreadPool::Scheduling scheduling;
+		size_t threads;
+		bool affinity;
+		size_t batch;
+	};
+
+	struct Result
+	{
+		double seconds = 0;
+		size_t tasks = 0;
+		std::vector<long long> latencies;  // ns, see latency_ns above
+	};
+
+	const char* scheduling_name(ThreadPool::Scheduling scheduling)
+	{
+		switch (scheduling)
+		{
+		case ThreadPool::Scheduling::SHARED_QUEUE: return "shared_queue";
+		case ThreadPool::Scheduling::WORK_STEALING: return "work_stealing";
+		default: return "lock_free";
+		}
+	}
+
+	long long now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	double seconds_since(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	// Keeps the compiler from dropping the compute loops, read into
+	// checksum at exit
+	std::atomic<unsigned> sink{ 0 };
+	volatile unsigned checksum = 0;
+
+	unsigned tiny_compute(unsigned seed)
+	{
+		for (int i = 0; i < 64; ++i)
+			seed = seed * 1664525u + 1013904223u;
+		return seed;
+	}
+
+	std::unique_ptr<ThreadPool> make_pool(const Setup& setup)
+	{
+		ThreadPool::Options options;
+		options.scheduling = setup.scheduling;
+		options.queue_capacity = 1 << 16;
+		options.dequeue_batch = setup.batch;
+		std::vector<int> cores;
+		if (setup.affinity)
+		{
+			const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+			for (size_t i = 0; i < setup.threads; ++i)
+				cores.push_back(static_cast<int>(i % cpus));
+		}
+		return std::unique_ptr<ThreadPool>(new ThreadPool(setup.threads, cores, ThreadPool::Priority::NORMAL, options));
+	}
+
+	// post() of empty tasks from one thread, then drain()
+	Result bench_empty(ThreadPool& pool, size_t tasks)
+	{
+		Result result;
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < tasks; ++i)
+			pool.post([] {});
+		pool.drain();
+		result.seconds = seconds_since(start);
+		result.tasks = tasks;
+		return result;
+	}
+
+	// enqueue() of small compute tasks, waiting on every future; also records
+	// the enqueue-to-start latency of each task
+	Result bench_tiny(ThreadPool& pool, size_t tasks)
+	{
+		Result result;
+		std::vector<long long> starts(tasks);
+		std::vector<long long> submits(tasks);
+		std::vector<std::future<unsigned>> futures;
+		futures.reserve(tasks);
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < tasks; ++i)
+		{
+			submits[i] = now_ns();
+			long long* slot = &starts[i];
+			futures.push_back(pool.enqueue([slot, i]
+				{
+					*slot = now_ns();
+					return tiny_compute(static_cast<unsigned>(i));
+				}));
+		}
+		unsigned total = 0;
+		for (std::future<unsigned>& future : futures)
+			total += future.get();
+		result.seconds = seconds_since(start);
+		result.tasks = tasks;
+		sink += total;
+		result.latencies.resize(tasks);
+		for (size_t i = 0; i < tasks; ++i)
+			result.latencies[i] = starts[i] - submits[i];
+		return result;
+	}
+
+	// Parents spawn children from inside the pool, the caller waits for all
+	Result bench_fanout(ThreadPool& pool, size_t tasks)
+	{
+		const size_t fanout = 16;
+		const size_t parents = std::max<size_t>(1, tasks / (fanout + 1));
+		Result result;
+		std::atomic<size_t> done{ 0 };
+		Clock::time_point start = Clock::now();
+		for (size_t p = 0; p < parents; ++p)
+		{
+			pool.post([&pool, &done, p]
+				{
+					for (size_t c = 0; c < fanout; ++c)
+						pool.post([&done, p, c]
+							{
+								sink += tiny_compute(static_cast<unsigned>(p * fanout + c));
+								done++;
+							});
+					done++;
+				});
+		}
+		pool.drain();
+		result.seconds = seconds_since(start);
+		result.tasks = done;
+		return result;
+	}
+
+	// Several external threads submitting at once
+	Result bench_producers(ThreadPool& pool, size_t tasks)
+	{
+		const size_t producers = std::max<size_t>(2, pool.size());
+		const size_t per_producer = tasks / producers;
+		Result result;
+		std::atomic<bool> go{ false };
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < producers; ++t)
+		{
+			threads.emplace_back([&pool, &go, per_producer]
+				{
+					while (!go)
+						std::this_thread::yield();
+					for (size_t i = 0; i < per_producer; ++i)
+						pool.post([] {});
+				});
+		}
+		Clock::time_point start = Clock::now();
+		go = true;
+		for (std::thread& thread : threads)
+			thread.join();
+		pool.drain();
+		result.seconds = seconds_since(start);
+		result.tasks = per_producer * producers;
+		return result;
+	}
+
+	// Cost of drain() on an idle pool and right after a single task
+	Result bench_drain(ThreadPool& pool, size_t tasks)
+	{
+		const size_t rounds = std::max<size_t>(1, tasks / 100);
+		Result result;
+		result.latencies.reserve(rounds);
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < rounds; ++i)
+		{
+			pool.post([] {});
+			long long begin = now_ns();
+			pool.drain();
+			result.latencies.push_back(now_ns() - begin);
+		}
+		result.seconds = seconds_since(start);
+		result.tasks = rounds;
+		return result;
+	}
+
+	long long percentile(std::vector<long long>& values, double q)
+	{
+		if (values.empty())
+			return 0;
+		size_t index = std::min(values.size() - 1, static_cast<size_t>(q * values.size()));
+		std::nth_element(values.begin(), values.begin() + index, values.end());
+		return values[index];
+	}
+
+	std::vector<size_t> parse_list(const char* text)
+	{
+		std::vector<size_t> values;
+		for (const char* p = text; *p;)
+		{
+			values.push_back(static_cast<size_t>(std::strtoul(p, nullptr, 10)));
+			p = std::strchr(p, ',');
+			if (!p)
+				break;
+			++p;
+		}
+		return values;
+	}
+
+	int usage(const char* program)
+	{
+		std::fprintf(stderr, "usage: %s [--threads 1,2,4] [--tasks N] [--repeat N] [--batch N] [--quick]\n"
+			"  thread counts, N of tasks and of repetitions must be at least 1\n", program);
+		return 2;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+			config.threads = parse_list(argv[++i]);
+		else if (!std::strcmp(argv[i], "--tasks") && i + 1 < argc)
+			config.tasks = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+		else if (!std::strcmp(argv[i], "--repeat") && i + 1 < argc)
+			config.repeat = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+		else if (!std::strcmp(argv[i], "--batch") && i + 1 < argc)
+			config.batch = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+		else if (!std::strcmp(argv[i], "--quick"))
+		{
+			config.tasks = 20000;
+			config.repeat = 1;
+		}
+		else
+			return usage(argv[0]);
+	}
+	// No run, or a pool without workers, has nothing to report (0/0 is no JSON number)
+	if (config.tasks == 0 || config.repeat == 0
+		|| std::find(config.threads.begin(), config.threads.end(), size_t(0)) != config.threads.end())
+		return usage(argv[0]);
+	if (config.threads.empty())
+	{
+		const size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t n = 1; n < cpus; n *= 2)
+			config.threads.push_back(n);
+		config.threads.push_back(cpus);
+	}
+
+	typedef Result (*Benchmark)(ThreadPool&, size_t);
+	const struct
+	{
+		const char* name;
+		Benchmark run;
+	} benchmarks[] = {
+		{ "empty_post", bench_empty },
+		{ "tiny_enqueue", bench_tiny },
+		{ "fan_out_in", bench_fanout },
+		{ "producers", bench_producers },
+		{ "drain", bench_drain },
+	};
+	const ThreadPool::Scheduling modes[] = {
+		ThreadPool::Scheduling::SHARED_QUEUE,
+		ThreadPool::Scheduling::WORK_STEALING,
+		ThreadPool::Scheduling::LOCK_FREE,
+	};
+
+	std::printf("[\n");
+	bool first = true;
+	for (ThreadPool::Scheduling mode : modes)
+	{
+		for (size_t threads : config.threads)
+		{
+			for (int affinity = 0; affinity < 2; ++affinity)
+			{
+				Setup setup = { mode, threads, affinity != 0, config.batch };
+				std::unique_ptr<ThreadPool> pool = make_pool(setup);
+				for (const auto& benchmark : benchmarks)
+				{
+					// Best throughput of the repetitions, latencies of all of them
+					Result best;
+					std::vector<long long> latencies;
+					for (size_t r = 0; r < config.repeat; ++r)
+					{
+						Result result = benchmark.run(*pool, config.tasks);
+						latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+						if (best.tasks == 0 || result.tasks / result.seconds > best.tasks / best.seconds)
+							best = result;
+					}
+					std::printf("%s  {\"benchmark\": \"%s\", \"scheduling\": \"%s\", \"threads\": %zu, "
+						"\"affinity\": %s, \"batch\": %zu, \"tasks\": %zu, \"seconds\": %.6f, \"tasks_per_sec\": %.0f",
+						first ? "" : ",\n", benchmark.name, scheduling_name(mode), threads,
+						setup.affinity ? "true" : "false", setup.batch, best.tasks, best.seconds, best.tasks / best.seconds);
+					if (!latencies.empty())
+					{
+						std::printf(", \"latency_ns\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}",
+							percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+							percentile(latencies, 0.999), *std::max_element(latencies.begin(), latencies.end()));
+					}
+					std::printf("}");
+					first = false;
+					std::fflush(stdout);
+				}
+			}
+		}
+	}
+	std::printf("\n]\n");
+	checksum = sink.load();
+	return 0;
+}
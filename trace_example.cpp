@@ -0,0 +1,100 @@
+﻿#include <atomic>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "TraceRecorder.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+	if (!ok)
+		++failures;
+}
+
+// Brackets balance outside of strings and every string is closed
+static bool well_formed(const std::string& json)
+{
+	int depth = 0;
+	bool in_string = false;
+	for (size_t i = 0; i < json.size(); ++i)
+	{
+		const char c = json[i];
+		if (in_string)
+		{
+			if (c == '\\')
+				++i;
+			else if (c == '"')
+				in_string = false;
+		}
+		else if (c == '"')
+			in_string = true;
+		else if (c == '{' || c == '[')
+			++depth;
+		else if (c == '}' || c == ']')
+		{
+			if (--depth < 0)
+				return false;
+		}
+	}
+	return depth == 0 && !in_string;
+}
+
+static size_t count(const std::string& text, const std::string& what)
+{
+	size_t n = 0;
+	for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + what.size()))
+		++n;
+	return n;
+}
+
+int main()
+{
+	ThreadPool pool(2);
+	TraceRecorder recorder;
+	recorder.attach(pool);
+
+	// Tags only live as long as their task: the recorder keeps a copy
+	for (int i = 0; i < 20; ++i)
+	{
+		std::shared_ptr<std::string> tag = std::make_shared<std::string>("decode \"frame\" " + std::to_string(i));
+		ThreadPool::TaskOptions options;
+		options.tag = tag->c_str();
+		pool.post(options, [tag] {});
+		pool.drain();
+	}
+	recorder.detach();
+
+	std::ostringstream out;
+	out.precision(3);
+	recorder.write_chrome_trace(out);
+	const std::string json = out.str();
+	check(json.compare(0, 16, "{\"traceEvents\": ") == 0 && well_formed(json), "the trace is well-formed JSON");
+	// A worker parked at detach() leaves its idle span open, tasks are closed
+	const size_t begins = count(json, "\"ph\": \"B\""), ends = count(json, "\"ph\": \"E\"");
+	check(count(json, "\"cat\": \"task\"") == 20 && ends >= 20 && ends <= begins && begins - ends <= 2,
+		"every task span is closed");
+	check(json.find("decode \\\"frame\\\" 19") != std::string::npos, "tags are copied and escaped");
+	check(!(out.flags() & std::ios_base::fixed) && out.precision() == 3, "the caller's stream format is kept");
+
+	// Replaced hook sets are freed once no worker calls them any more
+	std::shared_ptr<int> owner = std::make_shared<int>(0);
+	std::atomic<int> calls(0);
+	for (int i = 0; i < 1000; ++i)
+	{
+		ThreadPool::TraceHooks hooks;
+		hooks.on_task_begin = [owner, &calls](const ThreadPool::TraceEvent&) { calls++; };
+		pool.set_trace_hooks(hooks);
+		pool.post([] {});
+	}
+	pool.drain();
+	pool.set_trace_hooks(ThreadPool::TraceHooks());
+	pool.post([] {});
+	pool.drain();
+	check(owner.use_count() == 1 && calls > 0, "replaced trace hooks are freed");
+
+	return failures == 0 ? 0 : 1;
+}